@@ -0,0 +1,170 @@
+#include <CLI/CLI.hpp>
+#include <kumi/tuple.hpp>
+
+import ttl;
+import std;
+
+namespace
+{
+	using namespace ttl::exec;
+
+	constexpr ttl::Tensor s = ttl::scalar("s");
+	constexpr ttl::Tensor u = ttl::vector("u");
+	constexpr ttl::Tensor w = ttl::vector("w");
+	constexpr ttl::Tensor A = ttl::matrix("A");
+	constexpr ttl::Tensor B = ttl::matrix("B");
+	constexpr ttl::Tensor P = ttl::Tensor("P", 4);
+	constexpr ttl::Tensor Q = ttl::Tensor("Q", 4);
+
+	/// A constant, it is never on a left-hand-side.
+	constexpr ttl::Tensor K = ttl::matrix("K");
+
+	/// Outputs.
+	constexpr ttl::Tensor r = ttl::scalar("r");
+	constexpr ttl::Tensor x = ttl::vector("x");
+	constexpr ttl::Tensor M = ttl::matrix("M");
+	constexpr ttl::Tensor T = ttl::Tensor("T", 4);
+
+	constexpr ttl::Index i = 'i';
+	constexpr ttl::Index j = 'j';
+	constexpr ttl::Index k = 'k';
+	constexpr ttl::Index l = 'l';
+
+	// Each system's first equation is the one that is measured, the rest just
+	// make its inputs into (non-constant) scalars.
+	constexpr ttl::System sum_identity = { M <<= A(i, j) + B(i, j), A <<= A(i, j), B <<= B(i, j) };
+	constexpr ttl::System sum_transpose = { M <<= A(i, j) + B(j, i), A <<= A(i, j), B <<= B(i, j) };
+	constexpr ttl::System sum_rank4 = { T <<= P(i, j, k, l) + Q(l, k, j, i), P <<= P(i, j, k, l), Q <<= Q(i, j, k, l) };
+	constexpr ttl::System difference_identity = { M <<= A(i, j) - B(i, j), A <<= A(i, j), B <<= B(i, j) };
+	constexpr ttl::System difference_transpose = { M <<= A(i, j) - B(j, i), A <<= A(i, j), B <<= B(i, j) };
+	constexpr ttl::System product_broadcast = { M <<= s * A(i, j), s <<= +s, A <<= A(i, j) };
+	constexpr ttl::System product_outer = { M <<= u(i) * w(j), u <<= u(i), w <<= w(i) };
+	constexpr ttl::System product_outer_rank4 = { T <<= A(i, j) * B(k, l), A <<= A(i, j), B <<= B(i, j) };
+	constexpr ttl::System product_dot = { r <<= u(i) * w(i), u <<= u(i), w <<= w(i) };
+	constexpr ttl::System product_gemv = { x <<= A(i, j) * u(j), A <<= A(i, j), u <<= u(i) };
+	constexpr ttl::System product_gemm = { M <<= A(i, k) * B(k, j), A <<= A(i, j), B <<= B(i, j) };
+	constexpr ttl::System product_double_contraction = { r <<= A(i, j) * B(i, j), A <<= A(i, j), B <<= B(i, j) };
+	constexpr ttl::System product_rank4_contraction = { M <<= P(i, j, k, l) * A(k, l), P <<= P(i, j, k, l), A <<= A(i, j) };
+	constexpr ttl::System ratio = { M <<= A(i, j) / s, s <<= +s, A <<= A(i, j) };
+	constexpr ttl::System scalar_trace = { r <<= A(i, i), A <<= A(i, j) };
+	constexpr ttl::System constant_gemv = { x <<= K(i, j) * u(j), u <<= u(i) };
+	constexpr ttl::System delta_outer = { M <<= ttl::delta(i, j) * s, s <<= +s };
+}
+
+namespace options
+{
+	long reps = 1 << 20;
+	std::string json = "kernels.json";
+}
+
+namespace
+{
+	struct Result {
+		std::string kernel;
+		std::string_view pattern;
+		double ns;
+		int flops;
+	};
+
+	/// Make the compiler assume that `p` is read and written, so that the
+	/// kernel isn't hoisted out of the timing loop.
+	void escape(void* p)
+	{
+		asm volatile("" : : "g"(p) : "memory");
+	}
+
+	/// Time the last node with the `tag` in the first equation of the system.
+	///
+	/// The tree is evaluated once to fill its stack, and then just the one
+	/// kernel is run repeatedly on that stack. All of the scalars and constants
+	/// are 1, so the in-place kernels don't drift into denormals.
+	template <auto const& system, Tag tag>
+	void run(std::string_view pattern, std::vector<Result>& results)
+	{
+		static constexpr ttl::ExecutableSystem<double, 3, system> sys;
+		constexpr int n = sys.first_equation;
+		constexpr auto const& serialized = kumi::get<n>(sys.serialized_trees);
+		constexpr int node = [] {
+			for (int k = serialized.tags.size() - 1; k >= 0; --k) {
+				if (serialized.tags[k] == tag) {
+					return k;
+				}
+			}
+			return -1;
+		}();
+		static_assert(node >= 0, "the equation doesn't contain the kernel");
+
+		auto const& tree = kumi::get<n>(sys.executable_trees);
+		typename std::remove_cvref_t<decltype(tree)>::Stack stack {};
+		auto scalars = [](int, int) {
+			return 1.0;
+		};
+		auto constants = [](int) {
+			return 1.0;
+		};
+		tree.evaluate(0, stack, scalars, constants);
+
+		double best = std::numeric_limits<double>::max();
+		for (int batch = 0; batch < 5; ++batch) {
+			auto t0 = std::chrono::steady_clock::now();
+			for (long rep = 0; rep < options::reps; ++rep) {
+				tree.template eval_kernel_step<node>(0, stack, scalars, constants);
+				escape(stack.data());
+			}
+			auto t1 = std::chrono::steady_clock::now();
+			best = std::min(best, std::chrono::duration<double, std::nano>(t1 - t0).count() / options::reps);
+		}
+
+		results.push_back({ std::format("{}", tag), pattern, best, serialized.flops(node) });
+		Result const& r = results.back();
+		std::print("{:<10} {:<20} {:>8.2f} ns {:>8.3f} GFLOP/s\n", r.kernel, r.pattern, r.ns, r.flops / r.ns);
+	}
+
+	void write_json(std::string const& path, std::vector<Result> const& results)
+	{
+		std::ofstream out(path);
+		out << "{\n  \"kernels\": [";
+		for (int n = 0; auto const& r : results) {
+			out << (n++ ? ",\n" : "\n");
+			out << std::format(
+				"    {{\"kernel\": \"{}\", \"pattern\": \"{}\", \"N\": 3, \"ns\": {}, \"flops\": {}}}",
+				r.kernel, r.pattern, r.ns, r.flops);
+		}
+		out << "\n  ]\n}\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	auto app = CLI::App("Throughput of the individual ExecutableTree kernels at N=3");
+	app.add_option("--reps", options::reps, "Number of kernel invocations per timed batch");
+	app.add_option("--json", options::json, "Path of the JSON results (empty to disable)");
+	app.parse(argc, app.ensure_utf8(argv));
+
+	std::vector<Result> results;
+	run<sum_identity, SUM>("ij + ij", results);
+	run<sum_transpose, SUM>("ij + ji", results);
+	run<sum_rank4, SUM>("ijkl + lkji", results);
+	run<difference_identity, DIFFERENCE>("ij - ij", results);
+	run<difference_transpose, DIFFERENCE>("ij - ji", results);
+	run<product_broadcast, PRODUCT>("s * ij", results);
+	run<product_outer, PRODUCT>("i * j", results);
+	run<product_outer_rank4, PRODUCT>("ij * kl", results);
+	run<product_dot, PRODUCT>("i * i", results);
+	run<product_gemv, PRODUCT>("ij * j", results);
+	run<product_gemm, PRODUCT>("ik * kj", results);
+	run<product_double_contraction, PRODUCT>("ij * ij", results);
+	run<product_rank4_contraction, PRODUCT>("ijkl * kl", results);
+	run<ratio, RATIO>("ij / s", results);
+	run<sum_identity, SCALAR>("ij", results);
+	run<sum_rank4, SCALAR>("lkji", results);
+	run<scalar_trace, SCALAR>("ii", results);
+	run<constant_gemv, CONSTANT>("ij", results);
+	run<delta_outer, DELTA>("ij", results);
+
+	if (not options::json.empty()) {
+		write_json(options::json, results);
+	}
+
+	return 0;
+}
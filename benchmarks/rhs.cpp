@@ -0,0 +1,303 @@
+#include "ns.hpp"
+#include <CLI/CLI.hpp>
+#include <kumi/tuple.hpp>
+
+import ttl;
+import std;
+
+namespace
+{
+	constexpr ttl::Index i = 'i';
+	constexpr ttl::Index j = 'j';
+
+	// The Burgers system from examples/burgers.cpp.
+	constexpr ttl::Tensor ν = ttl::scalar("ν");
+	constexpr ttl::Tensor c = ttl::vector("c");
+	constexpr ttl::Tensor u = ttl::vector("u");
+
+	constexpr auto burgers = ttl::System {
+		u <<= ν * D(u(i), i, j) - (u(i) + c(i)) * D(u(i), j)
+	};
+
+	// A tensor add, which is bound by memory bandwidth.
+	constexpr ttl::Tensor A = ttl::matrix("A");
+	constexpr ttl::Tensor B = ttl::matrix("B");
+	constexpr ttl::Tensor C = ttl::matrix("C");
+
+	// A and B are on a left-hand-side, as in kernels.cpp, so they are read
+	// for every point rather than hoisted into a single constant A + B.
+	constexpr auto tensor_add = ttl::System {
+		C <<= A(i, j) + B(j, i) + C(i, j),
+		A <<= A(i, j),
+		B <<= B(i, j)
+	};
+}
+
+namespace options
+{
+	int points = 1 << 16;
+	int reps = 10;
+	std::string json = "rhs.json";
+	std::vector<std::string> systems = { "navier_stokes", "burgers", "tensor_add" };
+	std::vector<std::string> modes = { "serial", "simd", "threads", "scalarized", "stencil" };
+}
+
+namespace
+{
+	struct Result {
+		std::string_view system;
+		int N;
+		std::string_view mode;
+		int points;
+		double seconds;
+		double flops_per_point;
+		double bytes_per_point;
+
+		auto points_per_second() const -> double
+		{
+			return points / seconds;
+		}
+
+		auto gflops() const -> double
+		{
+			return flops_per_point * points / seconds * 1e-9;
+		}
+	};
+
+	/// The estimated flops that the system performs for each point.
+	template <auto const& sys>
+	constexpr int flops_per_point = []<std::size_t... n>(std::index_sequence<n...>) {
+		auto flops = [](auto const& tree) {
+			int sum = 0;
+			for (int k = 0; k < int(tree.tags.size()); ++k) {
+				sum += tree.flops(k);
+			}
+			return sum;
+		};
+		return (flops(kumi::get<sys.first_point_tree + n>(sys.serialized_trees)) + ... + 0);
+	}(std::make_index_sequence<sys.n_trees - sys.first_point_tree>());
+
+	bool selected(std::vector<std::string> const& list, std::string_view name)
+	{
+		return std::find(list.begin(), list.end(), name) != list.end();
+	}
+
+	/// Evaluate the system over smooth fields of `options::points` points.
+	///
+	/// Each field is stored contiguously and offset from the others, so the
+	/// accessors look like the ones a structured-grid code would pass. The
+	/// best time over `options::reps` evaluations is reported.
+	template <auto const& sys>
+	void run(std::string_view name, int N, auto const& constants, std::vector<Result>& results)
+	{
+		int n = options::points;
+		int n_fields = sys.scalars.size();
+
+		std::vector<double> fields(std::size_t(n_fields) * n);
+		std::vector<double> rhs(fields.size());
+		for (int id = 0; id < n_fields; ++id) {
+			for (int x = 0; x < n; ++x) {
+				fields[std::size_t(id) * n + x] = 1.0 + 0.1 * std::sin(2.0 * std::numbers::pi * (double(x) / n + 0.1 * id));
+			}
+		}
+
+		auto scalars = [&](int id, int x) {
+			return fields[std::size_t(id) * n + x];
+		};
+
+		auto k = [&](int id) {
+			return kumi::get<1>(constants[id]);
+		};
+
+		auto out = [&](int id, int x) -> double& {
+			return rhs[std::size_t(id) * n + x];
+		};
+
+		auto time = [&](auto&& evaluate) {
+			evaluate();
+			double best = std::numeric_limits<double>::max();
+			for (int r = 0; r < options::reps; ++r) {
+				auto t0 = std::chrono::steady_clock::now();
+				evaluate();
+				auto t1 = std::chrono::steady_clock::now();
+				best = std::min(best, std::chrono::duration<double>(t1 - t0).count());
+			}
+			return best;
+		};
+
+		// Every scalar is read once and every output is written once.
+		double bytes = sizeof(double) * (sys.scalars.size() + sys.outputs.size());
+
+		auto record = [&](std::string_view mode, double seconds, int points = 0, double bytes_per_point = 0) {
+			points = (points) ? points : n;
+			bytes_per_point = (bytes_per_point) ? bytes_per_point : bytes;
+			results.push_back({ name, N, mode, points, seconds, double(flops_per_point<sys>), bytes_per_point });
+			Result const& r = results.back();
+			std::print("{:<14} N={} {:<8} {:>12.4g} points/s {:>8.3f} GFLOP/s {:>6} B/point\n",
+				r.system, r.N, r.mode, r.points_per_second(), r.gflops(), r.bytes_per_point);
+		};
+
+		if (selected(options::modes, "serial")) {
+			record("serial", time([&] {
+				sys.evaluate(0, n, scalars, k, out);
+			}));
+		}
+
+		if (selected(options::modes, "simd")) {
+			record("simd", time([&] {
+				sys.template evaluate_simd<4>(0, n, scalars, k, out);
+			}));
+		}
+
+		if (selected(options::modes, "threads")) {
+			ttl::ThreadPool pool;
+			typename std::remove_cvref_t<decltype(sys)>::Workspaces workspaces;
+			record("threads", time([&] {
+				sys.evaluate(pool, 0, n, workspaces, scalars, k, out, ttl::update::assign());
+			}));
+		}
+
+		if (selected(options::modes, "scalarized")) {
+			record("scalarized", time([&] {
+				sys.evaluate_scalarized(0, n, scalars, k, out);
+			}));
+		}
+
+		// The derivatives are computed from the primal fields on a padded
+		// cube of about the same number of points, rather than read.
+		if (selected(options::modes, "stencil")) {
+			using Stencil = typename std::remove_cvref_t<decltype(sys)>::template Stencil<>;
+			using Extents = decltype(Stencil::extents);
+			constexpr int D = std::tuple_size_v<Extents>;
+			constexpr int h = Stencil::halo;
+
+			int m = std::max(1, int(std::round(std::pow(double(n), 1.0 / D))));
+			Extents extents;
+			std::array<double, D> spacing;
+			extents.fill(m + 2 * h);
+			spacing.fill(1.0 / m);
+			Stencil stencil(extents, spacing);
+
+			int size = 1;
+			for (int e : extents) {
+				size *= e;
+			}
+
+			std::vector<double> primals(std::size_t(Stencil::n_primals) * size);
+			for (int p = 0; p < Stencil::n_primals; ++p) {
+				for (int x = 0; x < size; ++x) {
+					primals[std::size_t(p) * size + x] = 1.0 + 0.1 * std::sin(2.0 * std::numbers::pi * (double(x) / size + 0.1 * p));
+				}
+			}
+
+			std::vector<double> padded_rhs(std::size_t(n_fields) * size);
+			auto fields = [&](int p, int x) {
+				return primals[std::size_t(p) * size + x];
+			};
+			auto padded_out = [&](int id, int x) -> double& {
+				return padded_rhs[std::size_t(id) * size + x];
+			};
+			auto derivatives = stencil(fields);
+
+			// Evaluate the interior one row of x at a time.
+			int points = 1;
+			for (int d = 0; d < D; ++d) {
+				points *= m;
+			}
+			record("stencil", time([&] {
+				std::array<int, D> x;
+				x.fill(h);
+				while (true) {
+					int i = stencil.index(x);
+					sys.evaluate(i, i + m, derivatives, k, padded_out);
+					int d = 1;
+					while (d < D && ++x[d] == m + h) {
+						x[d++] = h;
+					}
+					if (d == D) {
+						break;
+					}
+				}
+			}), points, sizeof(double) * (Stencil::n_primals + sys.outputs.size()));
+		}
+	}
+
+	template <int N>
+	void run_navier_stokes(std::vector<Result>& results)
+	{
+		static constexpr auto sys = ttl::ExecutableSystem<double, N, ns::navier_stokes>();
+		auto constants = [&]<std::size_t... n>(std::index_sequence<n...>) {
+			return sys.map_constants(
+				ns::γ = 1.4,
+				ns::cv = 717.0,
+				ns::κ = 0.02545,
+				ns::μ = 1.9e-5,
+				ns::μv = 1e-5,
+				(ns::g(int(n)) = double(n))...);
+		}(std::make_index_sequence<N>());
+		run<sys>("navier_stokes", N, constants, results);
+	}
+
+	template <int N>
+	void run_burgers(std::vector<Result>& results)
+	{
+		static constexpr auto sys = ttl::ExecutableSystem<double, N, burgers>();
+		auto constants = [&]<std::size_t... n>(std::index_sequence<n...>) {
+			return sys.map_constants(ν = 1e-3, (c(int(n)) = 0.5)...);
+		}(std::make_index_sequence<N>());
+		run<sys>("burgers", N, constants, results);
+	}
+
+	template <int N>
+	void run_tensor_add(std::vector<Result>& results)
+	{
+		static constexpr auto sys = ttl::ExecutableSystem<double, N, tensor_add>();
+		auto constants = sys.map_constants();
+		run<sys>("tensor_add", N, constants, results);
+	}
+
+	void write_json(std::string const& path, std::vector<Result> const& results)
+	{
+		std::ofstream out(path);
+		out << "{\n  \"benchmarks\": [";
+		for (int n = 0; auto const& r : results) {
+			out << (n++ ? ",\n" : "\n");
+			out << std::format(
+				"    {{\"system\": \"{}\", \"N\": {}, \"mode\": \"{}\", \"points\": {}, \"seconds\": {}, "
+				"\"points_per_second\": {}, \"gflops\": {}, \"flops_per_point\": {}, \"bytes_per_point\": {}}}",
+				r.system, r.N, r.mode, r.points, r.seconds, r.points_per_second(), r.gflops(), r.flops_per_point, r.bytes_per_point);
+		}
+		out << "\n  ]\n}\n";
+	}
+}
+
+int main(int argc, char** argv)
+{
+	auto app = CLI::App("Right-hand-side throughput of the example systems");
+	app.add_option("--points", options::points, "Number of points per evaluation");
+	app.add_option("--reps", options::reps, "Number of timed evaluations (the best is reported)");
+	app.add_option("--json", options::json, "Path of the JSON results (empty to disable)");
+	app.add_option("--systems", options::systems, "Systems to run (navier_stokes, burgers, tensor_add)");
+	app.add_option("--modes", options::modes, "Evaluation modes to run (serial, simd, threads, scalarized, stencil)");
+	app.parse(argc, app.ensure_utf8(argv));
+
+	std::vector<Result> results;
+
+	[&]<int... N>(std::integer_sequence<int, N...>) {
+		if (selected(options::systems, "navier_stokes")) {
+			(run_navier_stokes<N>(results), ...);
+		}
+		if (selected(options::systems, "burgers")) {
+			(run_burgers<N>(results), ...);
+		}
+		if (selected(options::systems, "tensor_add")) {
+			(run_tensor_add<N>(results), ...);
+		}
+	}(std::integer_sequence<int, 1, 2, 3>());
+
+	if (not options::json.empty()) {
+		write_json(options::json, results);
+	}
+
+	return 0;
+}
@@ -1,4 +1,7 @@
+#include <kumi/tuple.hpp>
+
 import ttl;
+import std;
 
 namespace
 {
@@ -17,10 +20,50 @@ namespace
 	/// System of equations.
 	constexpr auto u_rhs = ν * D(u(i), i, j) - (u(i) + c(i)) * D(u(i), j);
 	constexpr ttl::System burgers = { u <<= u_rhs };
-	[[maybe_unused]] constexpr ttl::ExecutableSystem<double, 1, burgers> burgers1d;
+	constexpr ttl::ExecutableSystem<double, 1, burgers> burgers1d;
 }
 
 int main()
 {
+	// A periodic domain of n points, with the derivatives computed by
+	// finite differences and SSP-RK3 in time.
+	using System = std::remove_cvref_t<decltype(burgers1d)>;
+	using Stencil = System::Stencil<2>;
+	constexpr int h = Stencil::halo;
+	constexpr int n = 128;
+
+	Stencil stencil({ n + 2 * h }, { 1.0 / n });
+	ttl::RungeKutta<System, ttl::rk::SSPRK3> rk(n + 2 * h, h, n + h);
+
+	constexpr int ux = Stencil::scalar_ids[0];
+	for (int x = 0; x < n; ++x) {
+		rk.state(ux, h + x) = std::sin(2.0 * std::numbers::pi * x / n);
+	}
+
+	auto constants = burgers1d.map_constants(ν = 1e-2, c(0) = 0.0);
+	auto k = [&](int id) {
+		return kumi::get<1>(constants[id]);
+	};
+
+	auto scalars = [&](auto u) {
+		for (int x = 0; x < h; ++x) {
+			u(ux, x) = u(ux, n + x);
+			u(ux, n + h + x) = u(ux, h + x);
+		}
+		return stencil([u](int p, int i) {
+			return u(Stencil::scalar_ids[p], i);
+		});
+	};
+
+	double dt = 0.2 / n;
+	while (rk.time < 0.5) {
+		rk.step(dt, scalars, k);
+	}
+
+	double max = 0;
+	for (int x = h; x < n + h; ++x) {
+		max = std::max(max, std::abs(rk.state(ux, x)));
+	}
+	std::print("max |u| at t = {}: {}\n", rk.time, max);
 	return 0;
 }
@@ -1,47 +1,11 @@
-#include "cm.hpp"
+#include "ns.hpp"
 #include <CLI/CLI.hpp>
 #include <kumi/tuple.hpp>
 
 import ttl;
 import std;
 
-namespace
-{
-	/// Model parameters
-	constexpr ttl::Tensor γ = ttl::scalar("γ");
-	constexpr ttl::Tensor μ = ttl::scalar("μ");
-	constexpr ttl::Tensor μv = ttl::scalar("μv");
-	constexpr ttl::Tensor cv = ttl::scalar("cv");
-	constexpr ttl::Tensor κ = ttl::scalar("κ");
-	constexpr ttl::Tensor g = ttl::vector("g");
-
-	/// Dependent variables
-	constexpr ttl::Tensor ρ = ttl::scalar("ρ");
-	constexpr ttl::Tensor e = ttl::scalar("e");
-	constexpr ttl::Tensor v = ttl::vector("v");
-
-	/// Tensor indices
-	constexpr ttl::Index i = 'i';
-	constexpr ttl::Index j = 'j';
-
-	/// Constitutive model terms
-	constexpr auto d = symmetrize(D(v(i), j));
-	constexpr auto p = cm::ideal_gas(ρ, e, γ);
-	constexpr auto σ = cm::newtonian_fluid(p, v, μ, μv);
-	constexpr auto θ = cm::calorically_perfect(e, cv);
-	constexpr auto q = cm::fouriers_law(θ, κ);
-
-	/// System of equations.
-	constexpr auto ρ_rhs = -D(ρ, i) * v(i) - ρ * D(v(i), i);
-	constexpr auto v_rhs = -D(v(i), j) * v(j) + D(σ(i, j), j) / ρ + g(i);
-	constexpr auto e_rhs = -v(i) * D(e, i) + σ(i, j) * d(i, j) / ρ - D(q(i), i) / ρ;
-
-	constexpr auto navier_stokes = ttl::System {
-		ρ <<= ρ_rhs,
-		v <<= v_rhs,
-		e <<= e_rhs
-	};
-}
+using namespace ns;
 
 namespace options
 {
@@ -53,6 +17,7 @@ namespace options
 	bool print_tensor_trees = false;
 	bool print_scalar_trees = false;
 	bool print_executable_trees = false;
+	bool print_jacobian = false;
 }
 
 template <int N>
@@ -80,6 +45,20 @@ int run_ns()
 		puts("");
 	}
 
+	if (options::print_scalar_trees) {
+		puts("scalar program:");
+		std::print("{}", navier_stokes_Nd.template scalar_program<>.to_string(navier_stokes_Nd.scalars, navier_stokes_Nd.constants));
+		puts("");
+	}
+
+	if (options::print_jacobian) {
+		puts("jacobian:");
+		for (auto const& [c, id] : navier_stokes_Nd.template jacobian_pattern<>) {
+			std::print("∂{}/∂{}\n", navier_stokes_Nd.scalars[navier_stokes_Nd.outputs[c]], navier_stokes_Nd.scalars[id]);
+		}
+		puts("");
+	}
+
 	if (std::find(options::eqns.begin(), options::eqns.end(), "ρ") != options::eqns.end()) {
 		if (options::print_parse_trees) {
 			std::print("parse: {} = {}\n", ρ, ρ_rhs.to_string());
@@ -172,12 +151,16 @@ int run_ns()
 		g(1) = 1, // no gravity
 		g(2) = 2); // no gravity
 
-	navier_stokes_Nd.evaluate(
+	std::vector<double> rhs(navier_stokes_Nd.scalars.size());
+	navier_stokes_Nd.evaluate(0, 1,
 		[](int id, int i) {
 			return 0;
 		},
 		[&](int id) {
 			return kumi::get<1>(constants[id]);
+		},
+		[&](int id, int i) -> double& {
+			return rhs[id];
 		});
 
 	// int n = (argc > 16) ? std::stoi(argv[1]) : 128; // args["N_POINTS"].asLong() : 0;
@@ -232,6 +215,7 @@ int main(int argc, char** argv)
 	app.add_option("-t", options::print_tensor_trees, "Print the tensor trees");
 	app.add_option("-s", options::print_scalar_trees, "Print the scalar trees");
 	app.add_option("-e", options::print_executable_trees, "Print the executable trees");
+	app.add_option("-j", options::print_jacobian, "Print the sparsity pattern of the jacobian");
 	app.parse(argc, app.ensure_utf8(argv));
 
 	switch (N) {
@@ -0,0 +1,50 @@
+// the Navier-Stokes system, shared by the example and the benchmarks
+#pragma once
+
+#include "cm.hpp"
+
+import ttl;
+
+namespace ns
+{
+	/// Model parameters
+	constexpr ttl::Tensor γ = ttl::scalar("γ");
+	constexpr ttl::Tensor μ = ttl::scalar("μ");
+	constexpr ttl::Tensor μv = ttl::scalar("μv");
+	constexpr ttl::Tensor cv = ttl::scalar("cv");
+	constexpr ttl::Tensor κ = ttl::scalar("κ");
+	constexpr ttl::Tensor g = ttl::vector("g");
+
+	/// Dependent variables
+	constexpr ttl::Tensor ρ = ttl::scalar("ρ");
+	constexpr ttl::Tensor e = ttl::scalar("e");
+	constexpr ttl::Tensor v = ttl::vector("v");
+
+	/// Tensor indices
+	constexpr ttl::Index i = 'i';
+	constexpr ttl::Index j = 'j';
+
+	/// Constitutive model terms, these are evaluated once per point and their
+	/// derivatives are expanded where the equations need them
+	constexpr ttl::Tensor p = ttl::scalar("p");
+	constexpr ttl::Tensor σ = ttl::matrix("σ");
+	constexpr ttl::Tensor θ = ttl::scalar("θ");
+	constexpr ttl::Tensor q = ttl::vector("q");
+
+	constexpr auto d = symmetrize(D(v(i), j));
+
+	/// System of equations.
+	constexpr auto ρ_rhs = -D(ρ, i) * v(i) - ρ * D(v(i), i);
+	constexpr auto v_rhs = -D(v(i), j) * v(j) + D(σ(i, j), j) / ρ + g(i);
+	constexpr auto e_rhs = -v(i) * D(e, i) + σ(i, j) * d(i, j) / ρ - D(q(i), i) / ρ;
+
+	constexpr auto navier_stokes = ttl::System {
+		ttl::let(p, cm::ideal_gas(ρ, e, γ)),
+		ttl::let(σ, cm::newtonian_fluid(p, v, μ, μv)),
+		ttl::let(θ, cm::calorically_perfect(e, cv)),
+		ttl::let(q, cm::fouriers_law(θ, κ)),
+		ρ <<= ρ_rhs,
+		v <<= v_rhs,
+		e <<= e_rhs
+	};
+}
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <array>
+#include <concepts>
+
+namespace ttl
+{
+	/// A dual number with `K` tangent directions.
+	///
+	/// This is used as the value type of an ExecutableTree in order to evaluate
+	/// forward-mode derivatives along with the values. Each tangent is carried
+	/// through the operations with the usual rules, so evaluating a system
+	/// whose scalars are seeded with the directions w_k produces the
+	/// right-hand-side and its K Jacobian-vector products J·w_k in one pass.
+	template <class T, int K>
+	struct Dual {
+		T v;       //!< the value
+		T d[K];    //!< the tangent in each direction
+
+		constexpr Dual()
+			: v {}
+			, d {}
+		{
+		}
+
+		/// A value with zero tangents.
+		constexpr Dual(std::convertible_to<T> auto x)
+			: v(T(x))
+			, d {}
+		{
+		}
+
+		constexpr Dual(T v, std::array<T, K> const& tangents)
+			: v(v)
+		{
+			for (int k = 0; k < K; ++k) {
+				d[k] = tangents[k];
+			}
+		}
+
+		constexpr static auto size() -> int
+		{
+			return K;
+		}
+
+		constexpr friend auto operator-(Dual const& a) -> Dual
+		{
+			Dual out;
+			out.v = -a.v;
+			for (int k = 0; k < K; ++k) {
+				out.d[k] = -a.d[k];
+			}
+			return out;
+		}
+
+		constexpr friend auto operator+=(Dual& a, Dual const& b) -> Dual&
+		{
+			a.v += b.v;
+			for (int k = 0; k < K; ++k) {
+				a.d[k] += b.d[k];
+			}
+			return a;
+		}
+
+		constexpr friend auto operator-=(Dual& a, Dual const& b) -> Dual&
+		{
+			a.v -= b.v;
+			for (int k = 0; k < K; ++k) {
+				a.d[k] -= b.d[k];
+			}
+			return a;
+		}
+
+		/// (ab)' = a'b + ab'
+		constexpr friend auto operator*=(Dual& a, Dual const& b) -> Dual&
+		{
+			for (int k = 0; k < K; ++k) {
+				a.d[k] = a.d[k] * b.v + a.v * b.d[k];
+			}
+			a.v *= b.v;
+			return a;
+		}
+
+		/// (a/b)' = (a' - (a/b)b') / b
+		constexpr friend auto operator/=(Dual& a, Dual const& b) -> Dual&
+		{
+			T rb = T(1) / b.v;
+			a.v *= rb;
+			for (int k = 0; k < K; ++k) {
+				a.d[k] = (a.d[k] - a.v * b.d[k]) * rb;
+			}
+			return a;
+		}
+
+		constexpr friend auto operator+(Dual a, Dual const& b) -> Dual
+		{
+			return a += b;
+		}
+
+		constexpr friend auto operator-(Dual a, Dual const& b) -> Dual
+		{
+			return a -= b;
+		}
+
+		constexpr friend auto operator*(Dual a, Dual const& b) -> Dual
+		{
+			return a *= b;
+		}
+
+		constexpr friend auto operator/(Dual a, Dual const& b) -> Dual
+		{
+			return a /= b;
+		}
+	};
+}
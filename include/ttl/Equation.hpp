@@ -19,6 +19,30 @@ namespace ttl
 		}
 	};
 
+	/// A named intermediate in a system.
+	///
+	/// The lhs is computed once per point and the equations (and later
+	/// definitions) refer to it like any other tensor. References to its
+	/// derivatives are expanded with the chain rule, so the system never needs
+	/// the derivatives of a definition as inputs.
+	template <is_tree Tree>
+	struct Definition : Equation<Tree> {
+		using is_definition_tag = void;
+		using Equation<Tree>::Equation;
+	};
+
+	/// Define `lhs` as `rhs`.
+	///
+	/// The components of `lhs` correspond to the outer index of `rhs`, in the
+	/// same way as they do for an equation. A definition may only refer to the
+	/// definitions before it in the system.
+	template <is_tree Tree>
+	constexpr auto let(Tensor const& lhs, Tree&& rhs)
+	{
+		assert(lhs.order() == rhs.outer().size());
+		return Definition<std::remove_cvref_t<Tree>>(lhs, std::forward<Tree>(rhs));
+	}
+
 	template <is_tree Tree>
 	constexpr auto Tensor::operator<<=(Tree&& rhs) const
 	{
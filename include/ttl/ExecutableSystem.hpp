@@ -1,91 +1,1073 @@
 #pragma once
 
 #include "ttl/ExecutableTree.hpp"
+#include "ttl/Dual.hpp"
+#include "ttl/Pack.hpp"
+#include "ttl/ScalarProgram.hpp"
 #include "ttl/SerializedTree.hpp"
+#include "ttl/Stencil.hpp"
+#include "ttl/ThreadPool.hpp"
+#include "ttl/cse.hpp"
+#include "ttl/hoist.hpp"
+#include "ttl/profile.hpp"
+#include "ttl/update.hpp"
+#include <algorithm>
 #include <array>
 #include <bitset>
+#include <cstdint>
+#include <cstdio>
 #include <kumi/tuple.hpp>
 #include <print>
+#include <string>
+#include <vector>
 
 namespace ttl
 {
 	template <class T, int N, auto const& system>
 	struct ExecutableSystem {
-		constexpr static auto shapes = system.shapes(N);
+		using value_type = T;
 
-		constexpr static auto serialize_trees()
-		{
-			return []<std::size_t... i>(std::index_sequence<i...>) {
-				auto tensor_trees = system.simplify_trees();
+		constexpr static int n_definitions = [] {
+			int n = 0;
+			system.definitions([&](auto&&...) { ++n; });
+			return n;
+		}();
 
-				set<Scalar> all = tensor_trees([](is_tree auto const&... tree) {
-					set<Scalar> all;
-					(tree.scalars(N, all), ...);
-					return all;
-				});
+		constexpr static int n_equations = system.equations.size() - n_definitions;
 
-				all.sort();
+		/// Check to see if a tensor is computed per point and only used within
+		/// the system, i.e., if it is a temporary or a definition.
+		constexpr static bool is_intermediate(Tensor const& t)
+		{
+			return is_temporary(t) || system.is_defined(t);
+		}
 
-				set<Scalar> constant_coefficients;
-				set<Scalar> scalars;
-				for (Scalar const& s : all) {
-					if (s.constant) {
-						constant_coefficients.emplace(s);
-					} else {
-						scalars.emplace(s);
+		/// Create the simplified trees for the system.
+		///
+		/// Common subexpressions are eliminated across all of the equations,
+		/// the temporaries and definitions that nothing reads are removed (e.g.,
+		/// a definition that is only used through its derivatives), and then
+		/// constant subtrees are hoisted. The vector begins with the trees
+		/// that compute the derived constants, followed by the trees that compute
+		/// the temporaries and definitions, followed by one tree for each
+		/// equation.
+		constexpr static auto make_trees() -> std::vector<TensorTree>
+		{
+			std::vector<TensorTree> trees;
+			trees.reserve(n_definitions + n_equations);
+			system.equations([&](is_equation auto const&... eqns) {
+				([&] {
+					if constexpr (is_definition<decltype(eqns)>) {
+						trees.push_back(system.simplify(eqns.lhs, eqns.rhs));
+					}
+				}(), ...);
+				([&] {
+					if constexpr (!is_definition<decltype(eqns)>) {
+						trees.push_back(system.simplify(eqns.lhs, eqns.rhs));
 					}
+				}(), ...);
+			});
+			int k = CommonSubexpressions::eliminate(trees, n_definitions);
+			CommonSubexpressions::prune(trees, n_definitions + k);
+			ConstantSubexpressions::hoist(trees, k);
+			return trees;
+		}
+
+		/// Split the scalars referenced in the trees into the non-constant scalars,
+		/// the constant coefficients, and the components of the temporaries and
+		/// definitions.
+		///
+		/// The sets are sorted, and the position of a scalar in its set is the id
+		/// that is used for it during evaluation (temporaries are numbered after
+		/// the scalars). The derived constants are sorted after the constants
+		/// that the user binds. The left-hand-side scalars are always included,
+		/// even if they do not appear on any right-hand-side.
+		constexpr static auto partition_scalars(std::vector<TensorTree> const& trees)
+		{
+			set<Scalar> all;
+			for (TensorTree const& tree : trees) {
+				tree.scalars(N, all);
+			}
+
+			all.sort();
+
+			set<Scalar> constant_coefficients;
+			set<Scalar> derived_constants;
+			set<Scalar> scalars;
+			set<Scalar> temporaries;
+			for (Scalar const& s : all) {
+				if (s.constant && is_temporary(s.tensor)) {
+					derived_constants.emplace(s);
+				} else if (s.constant) {
+					constant_coefficients.emplace(s);
+				} else if (is_intermediate(s.tensor)) {
+					temporaries.emplace(s);
+				} else {
+					scalars.emplace(s);
 				}
+			}
 
-				return kumi::make_tuple([&] {
-					constexpr auto const& shape = kumi::get<i>(shapes);
-					auto const& tree = kumi::get<i>(tensor_trees);
-					return SerializedTree<T, shape>(tree, scalars, constant_coefficients);
-				}()...);
-			}(std::make_index_sequence<shapes.size()>());
+			constant_coefficients.insert(derived_constants.begin(), derived_constants.end());
+			return kumi::make_tuple(std::move(scalars), std::move(constant_coefficients), std::move(temporaries));
 		}
 
-		constexpr static auto serialized_trees = serialize_trees();
+		/// The most trees that a system can have. Each temporary and hoisted
+		/// constant that make_trees() adds is numbered below
+		/// TTL_MAX_TEMPORARIES.
+		constexpr static int max_trees = TTL_MAX_TEMPORARIES + n_definitions + n_equations;
+
+		/// The sizes of the tables that analyze() produces, and the shape of each
+		/// tree.
+		///
+		/// The serialized trees' types depend on their shapes, so this is the
+		/// size pass of the usual two-step constexpr pattern, and analyze() is
+		/// the data pass. These are the only two places that create the trees.
+		struct Sizes {
+			int n_trees;
+			int n_constant_trees;
+			int n_scalars;
+			int n_constants;
+			int n_temporaries;
+			std::array<TreeShape, max_trees> shapes;
+		};
+
+		constexpr static Sizes sizes = [] {
+			auto trees = make_trees();
+			auto [scalars, constants, temporaries] = partition_scalars(trees);
+			int n_constant_trees = std::count_if(trees.begin(), trees.end(), [](TensorTree const& tree) {
+				return is_temporary(tree.lhs()) && tree.root()->constant;
+			});
+			Sizes out {
+				.n_trees = int(trees.size()),
+				.n_constant_trees = n_constant_trees,
+				.n_scalars = int(scalars.size()),
+				.n_constants = int(constants.size()),
+				.n_temporaries = int(temporaries.size()),
+				.shapes = {}
+			};
+			assert(out.n_trees <= max_trees);
+			for (int i = 0; i < out.n_trees; ++i) {
+				out.shapes[i] = trees[i].shape(N);
+			}
+			return out;
+		}();
+
+		constexpr static int n_trees = sizes.n_trees;
+
+		/// The number of trees that are evaluated once, when the constants are
+		/// bound (see BoundConstants).
+		constexpr static int n_constant_trees = sizes.n_constant_trees;
+
+		/// The number of trees that compute temporaries and definitions.
+		constexpr static int n_temporaries = n_trees - n_constant_trees - n_equations;
+
+		/// The index of the first tree that is evaluated for every point.
+		constexpr static int first_point_tree = n_constant_trees;
+
+		/// The index of the first equation tree.
+		constexpr static int first_equation = n_constant_trees + n_temporaries;
+
+		constexpr static auto shapes = [] {
+			std::array<TreeShape, n_trees> out;
+			std::copy_n(sizes.shapes.begin(), n_trees, out.begin());
+			return out;
+		}();
+
+		template <std::size_t... i>
+		static auto serialized_tuple(std::index_sequence<i...>) -> kumi::tuple<SerializedTree<T, shapes[i]>...>;
 
+		/// The type of the tuple of serialized trees.
+		using SerializedTrees = decltype(serialized_tuple(std::make_index_sequence<n_trees>()));
+
+		/// The tables that are derived from the simplified trees.
+		struct Tables {
+			SerializedTrees serialized;
+			std::array<Tensor, n_trees> lhs;
+			std::array<kumi::tuple<Index, Index>, n_trees> lhs_indices;
+			std::array<Scalar, sizes.n_scalars> scalars;
+			std::array<Scalar, sizes.n_constants> constants;
+			std::array<Scalar, sizes.n_temporaries> temporaries;
+		};
+
+		/// Build all of the tables, including the serialized trees, from a
+		/// single simplification of the system.
+		constexpr static auto analyze() -> Tables
+		{
+			auto trees = make_trees();
+			auto [scalars, constants, temporaries] = partition_scalars(trees);
+			Tables out {
+				.serialized = [&]<std::size_t... i>(std::index_sequence<i...>) {
+					return kumi::make_tuple(SerializedTree<T, shapes[i]>(trees[i], scalars, constants, temporaries)...);
+				}(std::make_index_sequence<n_trees>())
+			};
+			for (int i = 0; i < n_trees; ++i) {
+				out.lhs[i] = trees[i].lhs();
+				out.lhs_indices[i] = kumi::make_tuple(trees[i].lhs_index(), trees[i].outer());
+			}
+			out.scalars = to_array<sizes.n_scalars>(scalars);
+			out.constants = to_array<sizes.n_constants>(constants);
+			out.temporaries = to_array<sizes.n_temporaries>(temporaries);
+			return out;
+		}
+
+		constexpr static Tables tables = analyze();
+
+		constexpr static auto const& serialized_trees = tables.serialized;
+
+		constexpr static auto lhs = tables.lhs;
+
+		/// The index of each tree's lhs, and the (permuted) index of its root.
+		constexpr static auto lhs_indices = tables.lhs_indices;
+
+		constexpr static auto scalars = tables.scalars;
+
+		constexpr static auto constants = tables.constants;
+
+		constexpr static auto temporaries = tables.temporaries;
+
+		/// Create the executable trees for a value type.
+		///
+		/// The serialized trees are independent of the value type, so we can
+		/// instantiate them for both T and for packs of T.
+		template <class U>
 		constexpr static auto make_executable_trees()
 		{
 			return []<std::size_t... i>(std::index_sequence<i...>) {
 				return kumi::make_tuple([] {
-					constexpr auto const& shape = kumi::get<i>(shapes);
+					constexpr auto const& shape = shapes[i];
 					constexpr auto const& tree = kumi::get<i>(serialized_trees);
-					return ExecutableTree<T, shape, tree>();
+					return ExecutableTree<U, shape, tree>();
 				}()...);
-			}(std::make_index_sequence<shapes.size()>());
+			}(std::make_index_sequence<n_trees>());
 		}
 
-		constexpr static auto executable_trees = make_executable_trees();
+		constexpr static auto executable_trees = make_executable_trees<T>();
+
+		/// The executable trees that evaluate W points at once.
+		template <int W>
+		constexpr static auto simd_trees = make_executable_trees<Pack<T, W>>();
+
+		/// The executable trees that evaluate K tangents along with the values.
+		template <int K>
+		constexpr static auto dual_trees = make_executable_trees<Dual<T, K>>();
+
+		constexpr static int n_scalars = scalars.size();
+
+		/// Computes the derivative scalars from the primal fields on the fly,
+		/// with central differences that are accurate to order `P` (see
+		/// ttl::Stencil).
+		template <int P = 2>
+		using Stencil = ttl::Stencil<N, scalars, P>;
 
-		auto evaluate(auto const& scalars, auto const& constants) const
+		/// The number of constants that the user binds in map_constants(), the
+		/// rest of the constants are derived.
+		constexpr static int n_bound_constants = std::count_if(constants.begin(), constants.end(), [](Scalar const& s) {
+			return !is_temporary(s.tensor);
+		});
+
+		/// The scalar ids of the left-hand-side components of each tree.
+		///
+		/// The components are stored in the same (row-major) order as the
+		/// right-hand-side tensor that is left on the stack after evaluation,
+		/// which may be a permutation of the lhs index. The ids for temporaries
+		/// are numbered after the scalars, and the ids for the constant trees are
+		/// constant ids.
+		constexpr static auto lhs_ids = []<std::size_t... i>(std::index_sequence<i...>) {
+			return kumi::make_tuple([] {
+				constexpr Tensor t = lhs[i];
+				constexpr auto indices = lhs_indices[i];
+				std::array<int, ttl::pow(N, t.order())> ids;
+				ScalarIndex index(t.order());
+				int c = 0;
+				do {
+					Scalar scalar(t, index.select(kumi::get<1>(indices), kumi::get<0>(indices)), i < n_constant_trees, N);
+					if (scalar.constant) {
+						auto s = std::find(constants.begin(), constants.end(), scalar);
+						assert(s != constants.end());
+						ids[c++] = s - constants.begin();
+					} else if (auto s = std::find(scalars.begin(), scalars.end(), scalar); s != scalars.end()) {
+						ids[c++] = s - scalars.begin();
+					} else {
+						auto t = std::find(temporaries.begin(), temporaries.end(), scalar);
+						assert(t != temporaries.end());
+						ids[c++] = n_scalars + (t - temporaries.begin());
+					}
+				} while (index.carry_sum_inc(N));
+				return ids;
+			}()...);
+		}(std::make_index_sequence<n_trees>());
+
+		/// The scalar ids of all of the left-hand-side components in the system.
+		///
+		/// These are the ids that evaluate() will write through its output
+		/// accessor, in equation order.
+		constexpr static std::array outputs = []<std::size_t... i>(std::index_sequence<i...>) {
+			constexpr int M = (kumi::get<first_equation + i>(lhs_ids).size() + ... + 0);
+			std::array<int, M> out;
+			auto o = out.begin();
+			((o = std::copy(kumi::get<first_equation + i>(lhs_ids).begin(), kumi::get<first_equation + i>(lhs_ids).end(), o)), ...);
+			return out;
+		}(std::make_index_sequence<n_equations>());
+
+		/// Check to see if the scalar id is the left-hand-side of an equation.
+		constexpr static bool is_output(int id)
 		{
-			executable_trees([&](auto const&... tree) {
-				(tree.evaluate(scalars, constants), ...);
-			});
+			return std::find(outputs.begin(), outputs.end(), id) != outputs.end();
 		}
 
-		constexpr static set<Scalar> collect_scalars(bool constant)
+		/// Check each scalar id to see if it is read by a tree that is evaluated
+		/// for each point.
+		constexpr static auto is_point_scalar = [] {
+			std::array<bool, n_scalars> used {};
+			[&]<std::size_t... n>(std::index_sequence<n...>) {
+				([&] {
+					constexpr auto const& tree = kumi::get<first_point_tree + n>(serialized_trees);
+					for (int k = 0; k < shapes[first_point_tree + n].n_nodes; ++k) {
+						if (tree.tags[k] != exec::SCALAR) {
+							continue;
+						}
+						for (int const* id = tree.scalar_ids(k); id != tree.scalar_ids(k + 1); ++id) {
+							if (*id < n_scalars) {
+								used[*id] = true;
+							}
+						}
+					}
+				}(),
+					...);
+			}(std::make_index_sequence<n_trees - first_point_tree>());
+			return used;
+		}();
+
+		/// The scalars that are gathered into the workspace's registers before
+		/// a point is evaluated, in increasing order.
+		///
+		/// The same scalar is often read by many nodes, and by many trees (e.g.,
+		/// a velocity gradient component), so each one is gathered once per
+		/// point and all of the trees read the register instead.
+		constexpr static auto gathered_ids = [] {
+			std::array<int, std::count(is_point_scalar.begin(), is_point_scalar.end(), true)> out;
+			int g = 0;
+			for (int id = 0; id < n_scalars; ++id) {
+				if (is_point_scalar[id]) {
+					out[g++] = id;
+				}
+			}
+			return out;
+		}();
+
+		/// The register of each scalar id, or -1 if the scalar isn't gathered.
+		constexpr static auto gather_slots = [] {
+			std::array<int, n_scalars> out;
+			out.fill(-1);
+			for (int g = 0; g < int(gathered_ids.size()); ++g) {
+				out[gathered_ids[g]] = g;
+			}
+			return out;
+		}();
+
+		/// Expand the trees that are evaluated for each point into values in
+		/// `builder` (see ScalarProgramBuilder).
+		///
+		/// The trees are expanded in order, the components of the temporaries
+		/// are just values in the program, and the constants are loaded through
+		/// `constant(id)`.
+		///
+		/// @returns The value of each output, in the same order as `outputs`.
+		constexpr static auto expand_points(ScalarProgramBuilder& builder, auto const& constant)
 		{
-			set<Scalar> scalars;
-			serialized_trees([&](auto const&... tree) {
-				(tree.get_scalars(constant, scalars), ...);
-			});
-			scalars.sort();
-			return scalars;
+			using Value = ScalarProgramBuilder::Value;
+			std::vector<Value> temps(temporaries.size());
+			std::vector<Value> out;
+
+			[&]<std::size_t... n>(std::index_sequence<n...>) {
+				([&] {
+					constexpr auto const& tree = kumi::get<first_point_tree + n>(serialized_trees);
+					constexpr auto const& ids = kumi::get<first_point_tree + n>(lhs_ids);
+					auto rhs = tree.template interpret<Value>(
+						[&](int id) {
+							return (id < n_scalars) ? builder.load(exec::SCALAR, id) : temps[id - n_scalars];
+						},
+						constant);
+					for (unsigned c = 0; c < ids.size(); ++c) {
+						if constexpr (first_point_tree + n < first_equation) {
+							temps[ids[c] - n_scalars] = rhs[c];
+						} else {
+							out.push_back(rhs[c]);
+						}
+					}
+				}(),
+					...);
+			}(std::make_index_sequence<n_trees - first_point_tree>());
+
+			return out;
+		}
+
+		/// Expand the trees that are evaluated for each point into a single
+		/// straight-line program.
+		///
+		/// @returns The operations and the operation for each output.
+		constexpr static auto scalarize()
+		{
+			ScalarProgramBuilder builder;
+			std::vector<int> out;
+			for (auto const& rhs : expand_points(builder, [&](int id) { return builder.load(exec::CONSTANT, id); })) {
+				out.push_back(builder.operand(rhs));
+			}
+
+			auto ops = builder.compile(out);
+			return kumi::make_tuple(std::move(ops), std::move(out));
+		}
+
+		/// The straight-line program that computes all of the outputs for a point.
+		///
+		/// As with `simd_trees`, this is a template so that the system is only
+		/// scalarized if the program is used, e.g., `scalar_program<>`. The
+		/// number of operations is a template argument, so there is a size pass
+		/// and a data pass, but both interpret the stored serialized trees rather
+		/// than simplifying the system again.
+		template <class = void>
+		constexpr static auto scalar_program = [] {
+			constexpr int n_ops = kumi::get<0>(scalarize()).size();
+			auto [ops, out] = scalarize();
+			return ScalarProgram<n_ops, outputs.size()>(ops, out);
+		}();
+
+		/// Differentiate the scalarized outputs with respect to the non-constant
+		/// scalars.
+		///
+		/// The derivatives chain through the temporaries and definitions, which
+		/// are just values in the program, and entries that fold to zero are
+		/// dropped, so the pattern is the structural sparsity of the per-point
+		/// Jacobian. The columns include the derivative scalars (e.g.,
+		/// `∂vx_∂y`), which a solver combines with its discretization.
+		///
+		/// @returns The operations, the operation for each nonzero entry, and
+		///          the (output, scalar id) of each entry.
+		constexpr static auto differentiate_outputs()
+		{
+			// Start from the stored scalar program rather than scalarizing again.
+			auto const& program = scalar_program<>;
+			ScalarProgramBuilder builder;
+			for (ScalarOp const& op : program.ops) {
+				builder.intern(op);
+			}
+
+			auto gradients = builder.differentiate(program.ops.size());
+			std::vector<int> entries;
+			std::vector<kumi::tuple<int, int>> pattern;
+			for (int c = 0; c < int(program.outputs.size()); ++c) {
+				for (auto const& [id, d] : gradients[program.outputs[c]]) {
+					entries.push_back(builder.operand(d));
+					pattern.push_back({ c, id });
+				}
+			}
+
+			auto jacobian = builder.compile(entries);
+			return kumi::make_tuple(std::move(jacobian), std::move(entries), std::move(pattern));
+		}
+
+		/// The straight-line program that computes the nonzero entries of the
+		/// Jacobian for a point, and the (output, scalar id) of each entry,
+		/// where the output is a position in `outputs`.
+		///
+		/// The program is only generated if it is used (see `scalar_program`).
+		/// Its sizes are template arguments, so the outputs are differentiated
+		/// once for them and once more for the tuple, but both passes start from
+		/// the stored scalar program.
+		template <class = void>
+		constexpr static auto jacobian = [] {
+			constexpr auto n = [] {
+				auto [ops, entries, pattern] = differentiate_outputs();
+				return std::array { int(ops.size()), int(entries.size()) };
+			}();
+			auto [ops, entries, pattern] = differentiate_outputs();
+			std::array<kumi::tuple<int, int>, n[1]> out;
+			std::ranges::copy(pattern, out.begin());
+			return kumi::make_tuple(ScalarProgram<n[0], n[1]>(ops, entries), out);
+		}();
+
+		/// The Jacobian program, in the order of `jacobian_pattern`.
+		template <class = void>
+		constexpr static auto const& jacobian_program = kumi::get<0>(jacobian<>);
+
+		/// The (output, scalar id) of each nonzero entry of the Jacobian.
+		template <class = void>
+		constexpr static auto const& jacobian_pattern = kumi::get<1>(jacobian<>);
+
+		/// Build the adjoint of the scalarized outputs with respect to the
+		/// constants that the user binds.
+		///
+		/// The derived constants are expanded from the constant trees rather
+		/// than loaded, so that their sensitivities reach the bound constants
+		/// they are computed from. The output adjoints are loaded as scalars
+		/// numbered after the real scalars, one for each position in `outputs`,
+		/// and a reverse sweep over the forward operations (see
+		/// ScalarProgramBuilder::reverse()) collects the adjoint of each
+		/// constant. The forward and reverse sweeps end up in the same program.
+		///
+		/// @returns The operations, the operation for each constant that has a
+		///          nonzero adjoint, and the constant ids.
+		constexpr static auto adjoint_constants()
+		{
+			using Value = ScalarProgramBuilder::Value;
+			ScalarProgramBuilder builder;
+			std::vector<Value> derived(constants.size() - n_bound_constants);
+			auto constant = [&](int id) {
+				return (id < n_bound_constants) ? builder.load(exec::CONSTANT, id) : derived[id - n_bound_constants];
+			};
+
+			[&]<std::size_t... n>(std::index_sequence<n...>) {
+				([&] {
+					constexpr auto const& tree = kumi::get<n>(serialized_trees);
+					constexpr auto const& ids = kumi::get<n>(lhs_ids);
+					auto rhs = tree.template interpret<Value>(
+						[](int) -> Value {
+							assert(false);
+							return 0;
+						},
+						constant);
+					for (unsigned c = 0; c < ids.size(); ++c) {
+						derived[ids[c] - n_bound_constants] = rhs[c];
+					}
+				}(),
+					...);
+			}(std::make_index_sequence<n_constant_trees>());
+
+			std::vector<int> out;
+			for (auto const& rhs : expand_points(builder, constant)) {
+				out.push_back(builder.operand(rhs));
+			}
+
+			int n = builder.ops.size();
+			std::vector<Value> adj(n);
+			for (int c = 0; c < int(out.size()); ++c) {
+				adj[out[c]] += builder.load(exec::SCALAR, n_scalars + c);
+			}
+			builder.reverse(n, adj);
+
+			std::vector<int> entries;
+			std::vector<int> ids;
+			for (int k = 0; k < n; ++k) {
+				if (builder.ops[k].tag == exec::CONSTANT && !adj[k].is(0)) {
+					entries.push_back(builder.operand(adj[k]));
+					ids.push_back(builder.ops[k].a);
+				}
+			}
+
+			auto ops = builder.compile(entries);
+			return kumi::make_tuple(std::move(ops), std::move(entries), std::move(ids));
 		}
 
-		constexpr static std::array constants = [] {
-			constexpr int M = collect_scalars(true).size();
-			return to_array<M>(collect_scalars(true));
+		/// The straight-line program that computes the sensitivities of a point
+		/// to the bound constants, and the constant id of each of its outputs.
+		///
+		/// Like the Jacobian, this is only generated if it is used.
+		template <class = void>
+		constexpr static auto adjoint = [] {
+			constexpr auto n = [] {
+				auto [ops, entries, ids] = adjoint_constants();
+				return std::array { int(ops.size()), int(entries.size()) };
+			}();
+			auto [ops, entries, ids] = adjoint_constants();
+			std::array<int, n[1]> out;
+			std::ranges::copy(ids, out.begin());
+			return kumi::make_tuple(ScalarProgram<n[0], n[1]>(ops, entries), out);
 		}();
 
-		constexpr static std::array scalars = [] {
-			constexpr int M = collect_scalars(false).size();
-			return to_array<M>(collect_scalars(false));
+		/// The adjoint program, in the order of `adjoint_constant_ids`.
+		template <class = void>
+		constexpr static auto const& adjoint_program = kumi::get<0>(adjoint<>);
+
+		/// The constant id of each output of the adjoint program.
+		template <class = void>
+		constexpr static auto const& adjoint_constant_ids = kumi::get<1>(adjoint<>);
+
+		/// Create the stacks for the trees that are evaluated for each point.
+		template <class U>
+		constexpr static auto make_stacks()
+		{
+			return []<std::size_t... n>(std::index_sequence<n...>) {
+				return kumi::make_tuple(typename std::remove_cvref_t<decltype(kumi::get<first_point_tree + n>(make_executable_trees<U>()))>::Stack()...);
+			}(std::make_index_sequence<n_trees - first_point_tree>());
+		}
+
+		/// The scratch space needed to evaluate a point with value type U.
+		///
+		/// This contains a stack for each tree, the registers for the gathered
+		/// scalars, and the storage for the components of the temporaries.
+		template <class U>
+		struct BasicWorkspace {
+			using value_type = U;
+			decltype(make_stacks<U>()) stacks;
+			std::array<U, gathered_ids.size()> registers;
+			std::array<U, temporaries.size()> temps;
+		};
+
+		/// The scratch space needed to evaluate a point.
+		///
+		/// Each thread that is evaluating the system needs its own workspace,
+		/// but it can be reused for any number of points.
+		using Workspace = BasicWorkspace<T>;
+
+		/// The scratch space needed to evaluate W points at once.
+		template <int W>
+		using SimdWorkspace = BasicWorkspace<Pack<T, W>>;
+
+		/// The scratch space needed to evaluate K tangents.
+		template <int K>
+		using DualWorkspace = BasicWorkspace<Dual<T, K>>;
+
+		/// The offset of each tree's nodes in Profile::nodes.
+		constexpr static auto node_offsets = [] {
+			std::array<int, n_trees + 1> out {};
+			for (int n = 0; n < n_trees; ++n) {
+				out[n + 1] = out[n] + shapes[n].n_nodes;
+			}
+			return out;
 		}();
 
+		/// Cycle and invocation counts for each node of each tree.
+		///
+		/// Passing a Profile to evaluate() or evaluate_simd() times every node
+		/// (see ttl::profile). The counts accumulate across calls. The parallel
+		/// evaluate() gives each worker its own Profile and combines them, other
+		/// threads need their own Profile, and they can be combined with `+=`
+		/// before calling report().
+		struct Profile {
+			std::array<profile::Counter, n_trees> trees;
+			std::array<profile::Counter, node_offsets[n_trees]> nodes;
+
+			auto operator+=(Profile const& b) -> Profile&
+			{
+				for (int n = 0; n < n_trees; ++n) {
+					trees[n] += b.trees[n];
+				}
+				for (int k = 0; k < node_offsets[n_trees]; ++k) {
+					nodes[k] += b.nodes[k];
+				}
+				return *this;
+			}
+
+			/// Print the profile of each tree, one line per node.
+			///
+			/// Each node is listed with its tag, its outer and inner index, an
+			/// estimate of its flops, the percentage of the tree's time spent in
+			/// the node itself and in its subtree, and the subtree's expression.
+			void report(std::FILE* file = stdout) const
+			{
+				std::uint64_t total = 0;
+				for (int n = first_point_tree; n < n_trees; ++n) {
+					total += this->trees[n].cycles;
+				}
+
+				[&]<std::size_t... n>(std::index_sequence<n...>) {
+					(report_tree<first_point_tree + n>(file, total), ...);
+				}(std::make_index_sequence<n_trees - first_point_tree>());
+			}
+
+			template <std::size_t n>
+			void report_tree(std::FILE* file, std::uint64_t total) const
+			{
+				constexpr auto const& serialized = kumi::get<n>(serialized_trees);
+				constexpr int n_nodes = shapes[n].n_nodes;
+
+				auto percent = [](std::uint64_t a, std::uint64_t b) {
+					return (b) ? 100.0 * double(a) / double(b) : 0.0;
+				};
+
+				profile::Counter const& t = trees[n];
+				std::print(file, "{}({}): {:.1f}% of the system, {} calls, {} {}\n", lhs[n], kumi::get<0>(lhs_indices[n]), percent(t.cycles, total), t.count, t.cycles, profile::unit);
+
+				// The nodes of each subtree are contiguous and end at the subtree's
+				// root.
+				std::array<int, n_nodes> first;
+				for (int k = 0; k < n_nodes; ++k) {
+					first[k] = k;
+					if (exec::is_binary(serialized.tags[k])) {
+						first[k] = std::min(first[serialized.left(k)], first[serialized.right(k)]);
+					}
+				}
+
+				for (int k = 0; k < n_nodes; ++k) {
+					std::uint64_t self = nodes[node_offsets[n] + k].cycles;
+					std::uint64_t subtree = 0;
+					for (int j = first[k]; j <= k; ++j) {
+						subtree += nodes[node_offsets[n] + j].cycles;
+					}
+					std::print(file, "  {:>4} {:<10} {:>6}:{:<6} {:>8} {:>6.1f}% {:>6.1f}%  {}\n",
+						k,
+						serialized.tags[k],
+						serialized.index(k),
+						serialized.inner_index(k),
+						serialized.flops(k),
+						percent(self, t.cycles),
+						percent(subtree, t.cycles),
+						serialized.to_string(k));
+				}
+			}
+		};
+
+		/// A constants accessor with the derived constants filled in.
+		///
+		/// The derived constants are computed from the caller's `bound` accessor
+		/// when this is constructed, and the bound constants are read through to
+		/// it. The evaluate() overloads wrap their constants in this, once per
+		/// call, so they never read a derived constant from the caller.
+		template <class Bound>
+		struct BoundConstants {
+			using bound_constants_tag = void;
+
+			Bound const& bound;
+			std::array<T, constants.size() - n_bound_constants> derived {};
+
+			constexpr explicit BoundConstants(Bound const& bound)
+				: bound(bound)
+			{
+				[&]<std::size_t... n>(std::index_sequence<n...>) {
+					([&] {
+						constexpr auto const& tree = kumi::get<n>(serialized_trees);
+						constexpr auto const& ids = kumi::get<n>(lhs_ids);
+						auto rhs = tree.template interpret<T>(*this);
+						for (unsigned c = 0; c < ids.size(); ++c) {
+							derived[ids[c] - n_bound_constants] = rhs[c];
+						}
+					}(),
+						...);
+				}(std::make_index_sequence<n_constant_trees>());
+			}
+
+			constexpr auto operator()(int id) const -> T
+			{
+				return (id < n_bound_constants) ? T(bound(id)) : derived[id - n_bound_constants];
+			}
+		};
+
+		/// Add the derived constants to a constants accessor, unless it already
+		/// has them or the system doesn't have any.
+		template <class Constants>
+		constexpr static auto bind_constants(Constants const& constants) -> decltype(auto)
+		{
+			if constexpr (n_constant_trees == 0 or requires { typename Constants::bound_constants_tag; }) {
+				return (constants);
+			} else {
+				return BoundConstants<Constants>(constants);
+			}
+		}
+
+		/// Evaluate the system for all of the points in [begin, end).
+		///
+		/// The `scalars(id, i)` and `constants(id)` accessors provide the values
+		/// for the scalar and constant ids, and the right-hand-side of each
+		/// equation is written to `out(id, i)`, where `id` is the scalar id of
+		/// the corresponding left-hand-side component (see `outputs`).
+		///
+		/// Only the bound constants (the ids before `n_bound_constants`) are read
+		/// through `constants`. The derived constants are computed from them once
+		/// per call (see BoundConstants), so a table that the caller builds
+		/// itself doesn't need to provide them. This applies to all of the
+		/// evaluate() overloads.
+		void evaluate(int begin, int end, auto const& scalars, auto const& constants, auto&& out) const
+		{
+			evaluate(begin, end, scalars, constants, out, update::assign());
+		}
+
+		/// Evaluate the system, combining the right-hand-side with the output
+		/// using one of the fused `ttl::update` modes.
+		void evaluate(int begin, int end, auto const& scalars, auto const& constants, auto&& out, auto const& update) const
+		{
+			Workspace ws;
+			evaluate(begin, end, ws, scalars, constants, out, update);
+		}
+
+		/// Evaluate the system for [begin, end) using a caller-owned workspace.
+		void evaluate(int begin, int end, Workspace& ws, auto const& scalars, auto const& constants, auto&& out, auto const& update) const
+		{
+			auto const& k = bind_constants(constants);
+			for (int i = begin; i < end; ++i) {
+				evaluate_point(executable_trees, i, ws, scalars, k, out, update, profile::none());
+			}
+		}
+
+		/// Evaluate the system for [begin, end), recording the time spent in each
+		/// node and each tree in `prof`.
+		void evaluate(int begin, int end, Workspace& ws, auto const& scalars, auto const& constants, auto&& out, auto const& update, Profile& prof) const
+		{
+			auto const& k = bind_constants(constants);
+			for (int i = begin; i < end; ++i) {
+				evaluate_point(executable_trees, i, ws, scalars, k, out, update, prof);
+			}
+		}
+
+		/// A workspace for each worker of a ThreadPool, padded so that workers
+		/// don't share cache lines.
+		struct alignas(64) PaddedWorkspace {
+			Workspace ws;
+		};
+
+		using Workspaces = std::vector<PaddedWorkspace>;
+
+		/// Evaluate the system for [begin, end) in parallel.
+		///
+		/// The range is split into the pool's tiles, and each worker evaluates
+		/// its tiles with its own workspace, which is reused for every tile that
+		/// the worker executes. These overloads allocate the workspaces for each
+		/// call, a caller that evaluates repeatedly (e.g., a time stepper) should
+		/// keep its own Workspaces.
+		void evaluate(ThreadPool& pool, int begin, int end, auto const& scalars, auto const& constants, auto&& out) const
+		{
+			evaluate(pool, begin, end, scalars, constants, out, update::assign());
+		}
+
+		void evaluate(ThreadPool& pool, int begin, int end, auto const& scalars, auto const& constants, auto&& out, auto const& update) const
+		{
+			Workspaces workspaces;
+			evaluate(pool, begin, end, workspaces, scalars, constants, out, update);
+		}
+
+		/// Evaluate the system for [begin, end) in parallel, using caller-owned
+		/// per-worker workspaces.
+		///
+		/// The `workspaces` are grown to the size of the pool if necessary, and
+		/// can be reused for any number of calls.
+		void evaluate(ThreadPool& pool, int begin, int end, Workspaces& workspaces, auto const& scalars, auto const& constants, auto&& out, auto const& update) const
+		{
+			if (workspaces.size() < std::size_t(pool.size())) {
+				workspaces.resize(pool.size());
+			}
+
+			auto const& k = bind_constants(constants);
+			pool.parallel_for(begin, end, [&](int worker, int b, int e) {
+				evaluate(b, e, workspaces[worker].ws, scalars, k, out, update);
+			});
+		}
+
+		/// Evaluate the system for [begin, end) in parallel, recording the time
+		/// spent in each node and each tree in `prof`.
+		///
+		/// Each worker records into its own Profile, and the profiles are added
+		/// to `prof` when the job is done.
+		void evaluate(ThreadPool& pool, int begin, int end, Workspaces& workspaces, auto const& scalars, auto const& constants, auto&& out, auto const& update, Profile& prof) const
+		{
+			if (workspaces.size() < std::size_t(pool.size())) {
+				workspaces.resize(pool.size());
+			}
+
+			struct alignas(64) PaddedProfile {
+				Profile prof {};
+			};
+
+			auto const& k = bind_constants(constants);
+			std::vector<PaddedProfile> profiles(pool.size());
+			pool.parallel_for(begin, end, [&](int worker, int b, int e) {
+				evaluate(b, e, workspaces[worker].ws, scalars, k, out, update, profiles[worker].prof);
+			});
+
+			for (PaddedProfile const& p : profiles) {
+				prof += p.prof;
+			}
+		}
+
+		/// Evaluate the system for [begin, end), W points at a time.
+		///
+		/// Each stack slot holds a Pack of W points. The scalars are gathered
+		/// into the lanes of a pack, constants and immediates are broadcast, and
+		/// the lanes of the result are scattered back through the output
+		/// accessor. Any remainder that doesn't fill a pack is evaluated with the
+		/// scalar trees.
+		template <int W>
+		void evaluate_simd(int begin, int end, auto const& scalars, auto const& constants, auto&& out) const
+		{
+			evaluate_simd<W>(begin, end, scalars, constants, out, update::assign());
+		}
+
+		template <int W>
+		void evaluate_simd(int begin, int end, auto const& scalars, auto const& constants, auto&& out, auto const& update) const
+		{
+			evaluate_simd<W>(begin, end, scalars, constants, out, update, profile::none());
+		}
+
+		/// Evaluate the system for [begin, end), W points at a time, recording
+		/// the time spent in each node and each tree in `prof`.
+		///
+		/// Each count covers a whole pack of W points, except for the remainder.
+		template <int W>
+		void evaluate_simd(int begin, int end, auto const& scalars, auto const& constants, auto&& out, auto const& update, auto&& prof) const
+		{
+			SimdWorkspace<W> ws;
+			auto const& k = bind_constants(constants);
+			auto gather = [&](int id, int i) {
+				Pack<T, W> p;
+				for (int l = 0; l < W; ++l) {
+					p[l] = scalars(id, i + l);
+				}
+				return p;
+			};
+
+			int i = begin;
+			for (; i + W <= end; i += W) {
+				evaluate_point(simd_trees<W>, i, ws, gather, k, out, update, prof);
+			}
+
+			Workspace remainder;
+			for (; i < end; ++i) {
+				evaluate_point(executable_trees, i, remainder, scalars, k, out, update, prof);
+			}
+		}
+
+		/// Evaluate the system and K Jacobian-vector products for [begin, end).
+		///
+		/// The `seeds(id, i, k)` accessor provides the component of the kth
+		/// direction for each scalar id, and the kth product is written to
+		/// `tangents(id, i, k)` for each left-hand-side component. The
+		/// right-hand-side itself is written to `out(id, i)`, as for evaluate().
+		template <int K>
+		void evaluate_tangents(int begin, int end, auto const& scalars, auto const& seeds, auto const& constants, auto&& out, auto&& tangents) const
+		{
+			using U = Dual<T, K>;
+			DualWorkspace<K> ws;
+			auto const& bound = bind_constants(constants);
+
+			auto seeded = [&](int id, int i) {
+				U x = scalars(id, i);
+				for (int k = 0; k < K; ++k) {
+					x.d[k] = seeds(id, i, k);
+				}
+				return x;
+			};
+
+			// The update writes the value and the tangents to their accessors,
+			// so the dual output is just a sink.
+			U sink;
+			auto split = [&](U&, U const& rhs, int id, int i) {
+				out(id, i) = rhs.v;
+				for (int k = 0; k < K; ++k) {
+					tangents(id, i, k) = rhs.d[k];
+				}
+			};
+
+			for (int i = begin; i < end; ++i) {
+				evaluate_point(dual_trees<K>, i, ws, seeded, bound, [&](int, int) -> U& { return sink; }, split, profile::none());
+			}
+		}
+
+		/// Evaluate the system for [begin, end) with the straight-line program.
+		///
+		/// This computes the same values as evaluate(), but each point runs the
+		/// fully scalarized program rather than the executable trees, so there
+		/// are no loops, no stacks, and no workspace. This is usually the fastest
+		/// option for small systems and small N.
+		void evaluate_scalarized(int begin, int end, auto const& scalars, auto const& constants, auto&& out) const
+		{
+			evaluate_scalarized(begin, end, scalars, constants, out, update::assign());
+		}
+
+		void evaluate_scalarized(int begin, int end, auto const& scalars, auto const& constants, auto&& out, auto const& update) const
+		{
+			constexpr ScalarKernel<T, scalar_program<>> kernel;
+			auto const& k = bind_constants(constants);
+			for (int i = begin; i < end; ++i) {
+				kernel.evaluate(i, scalars, k, [&](int c, T const& rhs) {
+					update(out(outputs[c], i), rhs, outputs[c], i);
+				});
+			}
+		}
+
+		/// Evaluate the nonzero entries of the Jacobian for [begin, end).
+		///
+		/// Entry `k` (see `jacobian_pattern`) of point `i` is written to
+		/// `jac(k, i)`.
+		constexpr void evaluate_jacobian(int begin, int end, auto const& scalars, auto const& constants, auto&& jac) const
+		{
+			constexpr ScalarKernel<T, jacobian_program<>> kernel;
+			auto const& bound = bind_constants(constants);
+			for (int i = begin; i < end; ++i) {
+				kernel.evaluate(i, scalars, bound, [&](int k, T const& d) {
+					jac(k, i) = d;
+				});
+			}
+		}
+
+		/// Accumulate the gradient of an objective with respect to the bound
+		/// constants for [begin, end).
+		///
+		/// The `adjoints(id, i)` accessor provides the derivative of the
+		/// objective with respect to the right-hand-side `out(id, i)` of each
+		/// left-hand-side component, and the sensitivities are added to
+		/// `gradient[id]` for each bound constant id (the order of the array
+		/// returned by map_constants()). The constants that the system doesn't
+		/// depend on are left alone.
+		constexpr void evaluate_adjoint(int begin, int end, auto const& scalars, auto const& adjoints, auto const& constants, auto& gradient) const
+		{
+			constexpr ScalarKernel<T, adjoint_program<>> kernel;
+			auto read = [&](int id, int i) -> T {
+				return (id < n_scalars) ? T(scalars(id, i)) : T(adjoints(outputs[id - n_scalars], i));
+			};
+			for (int i = begin; i < end; ++i) {
+				kernel.evaluate(i, read, constants, [&](int c, T const& d) {
+					gradient[adjoint_constant_ids<>[c]] += d;
+				});
+			}
+		}
+
+		/// Evaluate all of the trees for the point (or pack of points) at `i`.
+		///
+		/// The scalars that the point reads are gathered into the workspace's
+		/// registers first, once each. The temporaries are evaluated next, and
+		/// their components are stored in the workspace, where they are read
+		/// back by the later trees.
+		void evaluate_point(auto const& trees, int i, auto& ws, auto const& scalars, auto const& constants, auto&& out, auto const& update, auto&& prof) const
+		{
+			using U = typename std::remove_cvref_t<decltype(ws)>::value_type;
+
+			for (unsigned g = 0; g < gathered_ids.size(); ++g) {
+				ws.registers[g] = U(scalars(gathered_ids[g], i));
+			}
+
+			auto read = [&](int id, int) -> U {
+				if constexpr (n_temporaries == 0) {
+					return ws.registers[gather_slots[id]];
+				} else {
+					return (id < n_scalars) ? ws.registers[gather_slots[id]] : ws.temps[id - n_scalars];
+				}
+			};
+
+			[&]<std::size_t... n>(std::index_sequence<n...>) {
+				(evaluate_tree<first_point_tree + n>(kumi::get<first_point_tree + n>(trees), i, kumi::get<n>(ws.stacks), read, constants, ws, out, update, prof), ...);
+			}(std::make_index_sequence<n_trees - first_point_tree>());
+		}
+
+		template <std::size_t n>
+		void evaluate_tree(auto const& tree, int i, auto& stack, auto const& scalars, auto const& constants, auto& ws, auto&& out, auto const& update, auto&& prof) const
+		{
+			constexpr auto const& ids = kumi::get<n>(lhs_ids);
+			if constexpr (profile::is_enabled<decltype(prof)>) {
+				std::uint64_t t = profile::clock();
+				tree.evaluate(i, stack, scalars, constants, [&](int k, std::uint64_t cycles) {
+					prof.nodes[node_offsets[n] + k].add(cycles);
+				});
+				prof.trees[n].add(profile::clock() - t);
+			} else {
+				tree.evaluate(i, stack, scalars, constants);
+			}
+			if constexpr (n < first_equation) {
+				for (unsigned c = 0; c < ids.size(); ++c) {
+					ws.temps[ids[c] - n_scalars] = tree.result(stack, c);
+				}
+			} else if constexpr (requires { tree.result(stack, 0)[0]; }) {
+				constexpr int W = decltype(tree.result(stack, 0))::size();
+				for (unsigned c = 0; c < ids.size(); ++c) {
+					auto const rhs = tree.result(stack, c);
+					for (int l = 0; l < W; ++l) {
+						update(out(ids[c], i + l), rhs[l], ids[c], i + l);
+					}
+				}
+			} else {
+				for (unsigned c = 0; c < ids.size(); ++c) {
+					update(out(ids[c], i), tree.result(stack, c), ids[c], i);
+				}
+			}
+		}
+
 		/// Take a set of user-bound scalar constants and turn them into an array
 		/// suitable for evaluate().
 		///
@@ -97,14 +1079,18 @@ namespace ttl
 		/// first one will be used.
 		///
 		/// All of the scalars in the problem must be provided at the same time.
+		///
+		/// The returned array also contains the derived constants (see
+		/// ConstantSubexpressions), so that they can be inspected. evaluate()
+		/// computes its own from the bound constants.
 		constexpr static auto map_constants(kumi::product_type auto... tuples)
 		{
-			constexpr int M = constants.size();
+			constexpr int M = n_bound_constants;
 			using Tuple = kumi::tuple<Scalar, double>;
 			static_assert((std::same_as<Tuple, decltype(tuples)> && ...));
-			std::array<Tuple, M> out;
+			std::array<Tuple, constants.size()> out;
 			auto begin = constants.begin();
-			auto end = constants.end();
+			auto end = constants.begin() + M;
 			std::bitset<M> bits;
 			([&] {
 				auto scalar = kumi::get<0>(tuples);
@@ -141,7 +1127,40 @@ namespace ttl
 				assert(false);
 			}
 
+			for (int n = M; n < int(constants.size()); ++n) {
+				out[n] = kumi::make_tuple(constants[n], 0.0);
+			}
+
+			derive_constants([&](int id) -> double& {
+				return kumi::get<1>(out[id]);
+			});
+
 			return out;
 		}
+
+		/// Evaluate the derived constants.
+		///
+		/// The `constants(id)` accessor must return a reference. The bound
+		/// constants are read through it and the derived constants are written
+		/// through it. This is called by map_constants(), and it can also be used
+		/// to fill in a table of constants that the caller manages.
+		constexpr static void derive_constants(auto&& constants)
+		{
+			[&]<std::size_t... n>(std::index_sequence<n...>) {
+				(derive_constant<n>(constants), ...);
+			}(std::make_index_sequence<n_constant_trees>());
+		}
+
+		template <std::size_t n>
+		constexpr static void derive_constant(auto&& constants)
+		{
+			constexpr auto const& tree = kumi::get<n>(serialized_trees);
+			constexpr auto const& ids = kumi::get<n>(lhs_ids);
+			using U = std::remove_cvref_t<decltype(constants(0))>;
+			auto rhs = tree.template interpret<U>(constants);
+			for (unsigned c = 0; c < ids.size(); ++c) {
+				constants(ids[c]) = rhs[c];
+			}
+		}
 	};
 }
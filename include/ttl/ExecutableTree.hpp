@@ -2,6 +2,9 @@
 
 #include "ttl/SerializedTree.hpp"
 #include "ttl/exec.hpp"
+#include "ttl/profile.hpp"
+#include <array>
+#include <utility>
 
 namespace ttl
 {
@@ -14,9 +17,123 @@ namespace ttl
 	/// these addresses _would_ be constexpr.
 	template <class T, TreeShape shape, serialized_tree auto tree>
 	struct ExecutableTree {
-		using Stack = T[shape.stack_depth];
+		using Stack = std::array<T, shape.stack_depth>;
 		constexpr static int N = shape.dims;
 
+		/// The strides of the `all` index space of the product `k` in its left
+		/// child, right child, and result (see exec::make_strides()).
+		template <int k>
+		constexpr static auto product_strides()
+		{
+			constexpr exec::Index all = tree.inner_index(k);
+			constexpr int M = all.size();
+			static_assert(all.is_unique());
+			static_assert(tree.index(tree.left(k)).is_unique() && tree.index(tree.right(k)).is_unique());
+			static_assert(tree.index(k).is_unique());
+			return std::array {
+				exec::make_strides<N, M>(all, tree.index(tree.left(k))),
+				exec::make_strides<N, M>(all, tree.index(tree.right(k))),
+				exec::make_strides<N, M>(all, tree.index(k))
+			};
+		}
+
+		/// A fixed nest of loops over the positions [d, e) of the product `k`'s
+		/// index space, with `d` innermost (it has the smallest stride).
+		///
+		/// The strides are compile-time constants, so the compiler sees the
+		/// plain loops over `N` that it would see for hand-written tensor code,
+		/// and calls `op(ia, ib, ic)` with the offsets for each element.
+		template <int k, int d, int e>
+		static void loop_nest(int ia, int ib, int ic, auto&& op)
+		{
+			if constexpr (d == e) {
+				op(ia, ib, ic);
+			} else {
+				constexpr static auto s = product_strides<k>();
+				for (int n = 0; n < N; ++n) {
+					loop_nest<k, d, e - 1>(ia + n * s[0][e - 1], ib + n * s[1][e - 1], ic + n * s[2][e - 1], op);
+				}
+			}
+		}
+
+		/// Check to see if node `k` and its children store all of their elements,
+		/// so that the kernel can use the plain row-major layouts.
+		template <int k>
+		constexpr static bool is_dense()
+		{
+			return tree.is_dense(k) && tree.is_dense(tree.left(k)) && tree.is_dense(tree.right(k));
+		}
+
+		/// The positions of the operands of each stored element of the sum or
+		/// difference `k`.
+		///
+		/// Element `n` of the result is `a[terms[n][0]] ± b[terms[n][1]]`, where
+		/// a position of -1 is a structural zero of that operand (see
+		/// SerializedTree::position()).
+		template <int k>
+		constexpr static auto sum_terms()
+		{
+			constexpr int l = tree.left(k);
+			constexpr int r = tree.right(k);
+			constexpr exec::Index ci = tree.index(k);
+			constexpr int M = ci.size();
+			constexpr std::array b_map = exec::make_map<N, M>(ci, tree.index(r));
+
+			std::array<std::array<int, 2>, tree.footprint(k)> out {};
+			for (int i = 0, n = 0; i < int(b_map.size()); ++i) {
+				if (tree.nonzero(k, i)) {
+					out[n++] = { tree.position(l, i), tree.position(r, b_map[i]) };
+				}
+			}
+			return out;
+		}
+
+		/// The positions of the operands and the result of each nonzero product
+		/// in the product `k`, in the order of the `all` index space.
+		///
+		/// The fourth position is 1 for the first product that is written to
+		/// each element of the result, which doesn't need to accumulate.
+		template <int k>
+		constexpr static auto product_terms()
+		{
+			constexpr int l = tree.left(k);
+			constexpr int r = tree.right(k);
+			constexpr exec::Index all = tree.inner_index(k);
+			constexpr int M = all.size();
+			constexpr std::array a_map = exec::make_map<N, M>(all, tree.index(l));
+			constexpr std::array b_map = exec::make_map<N, M>(all, tree.index(r));
+			constexpr std::array c_map = exec::make_map<N, M>(all, tree.index(k));
+
+			std::array<std::array<int, 4>, tree.n_products(k)> out {};
+			std::array<bool, c_map.size()> written {};
+			for (int i = 0, n = 0; i < int(c_map.size()); ++i) {
+				if (tree.nonzero(l, a_map[i]) && tree.nonzero(r, b_map[i])) {
+					out[n++] = { tree.position(k, c_map[i]), tree.position(l, a_map[i]), tree.position(r, b_map[i]), int(!written[c_map[i]]) };
+					written[c_map[i]] = true;
+				}
+			}
+			return out;
+		}
+
+		/// Compute the stored elements of the sum or difference `k` from the
+		/// stored elements of its operands.
+		template <int k>
+		static void eval_sparse_sum(T* const __restrict c, T const* const a, T const* const __restrict b)
+		{
+			constexpr static auto terms = sum_terms<k>();
+			constexpr static bool sum = (tree.tags[k] == exec::SUM);
+			for (unsigned n = 0; n < terms.size(); ++n) {
+				auto [ia, ib] = terms[n];
+				if (ib < 0) {
+					c[n] = a[ia];
+				} else if (ia < 0) {
+					c[n] = (sum) ? b[ib] : T() - b[ib];
+				} else {
+					c[n] = (sum) ? a[ia] + b[ib] : a[ia] - b[ib];
+				}
+			}
+		}
+
 		template <int k>
 		void eval_sum(Stack& stack) const
 		{
@@ -28,10 +145,11 @@ namespace ttl
 			constexpr static int rl = tree.stack_offset(l);
 			constexpr static int rr = tree.stack_offset(r);
 
-			// Not constexpr (see class note on multithreading).
-			T* const __restrict c = stack + rk;
-			T* const __restrict a = stack + rl;
-			T* const __restrict b = stack + rr;
+			// Not constexpr (see class note on multithreading). The result may be
+			// written in place over `a`, so `a` is derived from `c`.
+			T* const __restrict c = stack.data() + rk;
+			T const* const a = c + (rl - rk);
+			T const* const __restrict b = stack.data() + rr;
 
 			constexpr static exec::Index ci = tree.index(k);
 			constexpr static exec::Index ai = tree.index(l);
@@ -39,12 +157,17 @@ namespace ttl
 
 			static_assert(ci == ai);
 
-			// Map the index space.
-			constexpr static int M = ci.size();
-			constexpr static std::array b_map = exec::make_map<N, M>(ci, bi);
+			if constexpr (not is_dense<k>()) {
+				// Only the structural nonzeros are stored.
+				eval_sparse_sum<k>(c, a, b);
+			} else {
+				// Map the index space.
+				constexpr static int M = ci.size();
+				constexpr static std::array b_map = exec::make_map<N, M>(ci, bi);
 
-			for (unsigned i = 0; i < b_map.size(); ++i) {
-				c[i] = a[i] + b[b_map[i]];
+				for (unsigned i = 0; i < b_map.size(); ++i) {
+					c[i] = a[i] + b[b_map[i]];
+				}
 			}
 		}
 
@@ -59,10 +182,11 @@ namespace ttl
 			constexpr static int rl = tree.stack_offset(l);
 			constexpr static int rr = tree.stack_offset(r);
 
-			// Not constexpr (see class note on multithreading).
-			T* const __restrict c = stack + rk;
-			T* const __restrict a = stack + rl;
-			T* const __restrict b = stack + rr;
+			// Not constexpr (see class note on multithreading). The result may be
+			// written in place over `a`, so `a` is derived from `c`.
+			T* const __restrict c = stack.data() + rk;
+			T const* const a = c + (rl - rk);
+			T const* const __restrict b = stack.data() + rr;
 
 			constexpr static exec::Index ci = tree.index(k);
 			constexpr static exec::Index ai = tree.index(l);
@@ -70,12 +194,17 @@ namespace ttl
 
 			static_assert(ci == ai);
 
-			// Map the index space.
-			constexpr static int M = ci.size();
-			constexpr static std::array b_map = exec::make_map<N, M>(ci, bi);
+			if constexpr (not is_dense<k>()) {
+				// Only the structural nonzeros are stored.
+				eval_sparse_sum<k>(c, a, b);
+			} else {
+				// Map the index space.
+				constexpr static int M = ci.size();
+				constexpr static std::array b_map = exec::make_map<N, M>(ci, bi);
 
-			for (unsigned i = 0; i < b_map.size(); ++i) {
-				c[i] = a[i] - b[b_map[i]];
+				for (unsigned i = 0; i < b_map.size(); ++i) {
+					c[i] = a[i] - b[b_map[i]];
+				}
 			}
 		}
 
@@ -90,30 +219,66 @@ namespace ttl
 			constexpr static int rl = tree.stack_offset(l);
 			constexpr static int rr = tree.stack_offset(r);
 
-			T* const __restrict c = stack + rk;
-			T* const __restrict a = stack + rl;
-			T* const __restrict b = stack + rr;
+			T* const __restrict c = stack.data() + rk;
+			T const* const __restrict a = stack.data() + rl;
+			T const* const __restrict b = stack.data() + rr;
 
 			constexpr static exec::Index ci = tree.index(k);
 			constexpr static exec::Index all = tree.inner_index(k);
 			constexpr static exec::Index ai = tree.index(l);
 			constexpr static exec::Index bi = tree.index(r);
 
-			// Map the index space.
+			// The `all` index space of a product is its outer index followed by the
+			// contracted index, so the first O positions of the nest enumerate `c`
+			// in storage order and the rest enumerate the contraction. Every index
+			// that `a` and `b` share is contracted, so there's no elementwise
+			// product.
+			constexpr static int O = ci.size();
 			constexpr static int M = all.size();
-			constexpr static std::array c_map = exec::make_map<N, M>(all, ci);
-			constexpr static std::array a_map = exec::make_map<N, M>(all, ai);
-			constexpr static std::array b_map = exec::make_map<N, M>(all, bi);
-
-			// Don't know the state of the stack but we're going to need to accumulate
-			// there so we need to zero it first (it's nearly certainly dirty, either
-			// from previous frame or from previous evaluation)
-			for (unsigned i = 0; i < c_map.size(); ++i) {
-				c[i] = T();
-			}
 
-			for (unsigned i = 0; i < c_map.size(); ++i) {
-				c[c_map[i]] += a[a_map[i]] * b[b_map[i]];
+			if constexpr (bi.size() == 0 && ai == ci) {
+				// Broadcast a scalar `b` over `a`, which has the same nonzeros as
+				// the result.
+				constexpr static int n = tree.footprint(k);
+				T const s = b[0];
+				for (int i = 0; i < n; ++i) {
+					c[i] = a[i] * s;
+				}
+			} else if constexpr (ai.size() == 0 && bi == ci) {
+				// Broadcast a scalar `a` over `b`.
+				constexpr static int n = tree.footprint(k);
+				T const s = a[0];
+				for (int i = 0; i < n; ++i) {
+					c[i] = s * b[i];
+				}
+			} else if constexpr (not is_dense<k>()) {
+				// Only the nonzero products are computed, into the stored elements
+				// of the result.
+				constexpr static auto terms = product_terms<k>();
+				for (unsigned n = 0; n < terms.size(); ++n) {
+					auto [ic, ia, ib, first] = terms[n];
+					if (first) {
+						c[ic] = a[ia] * b[ib];
+					} else {
+						c[ic] += a[ia] * b[ib];
+					}
+				}
+			} else if constexpr (O == M) {
+				// An outer product, each element of `c` is written exactly once so
+				// it doesn't need to be zeroed.
+				loop_nest<k, 0, M>(0, 0, 0, [&](int ia, int ib, int ic) {
+					c[ic] = a[ia] * b[ib];
+				});
+			} else {
+				// A contraction (dot, matrix-vector, matrix-matrix, ...),
+				// accumulate each element of `c` in a register.
+				loop_nest<k, 0, O>(0, 0, 0, [&](int ia, int ib, int ic) {
+					T sum = T();
+					loop_nest<k, O, M>(ia, ib, 0, [&](int ja, int jb, int) {
+						sum += a[ja] * b[jb];
+					});
+					c[ic] = sum;
+				});
 			}
 		}
 
@@ -138,12 +303,18 @@ namespace ttl
 			constexpr static int rl = tree.stack_offset(l);
 			constexpr static int rr = tree.stack_offset(r);
 
-			T* const __restrict c = stack + rk;
-			T* const __restrict a = stack + rl;
-			T* const __restrict b = stack + rr;
-
-			auto rb = T(1) / b[0];
-			for (int i = 0; i < ttl::pow(N, ci.size()); ++i) {
+			// The result may be written in place over `a`.
+			T* const __restrict c = stack.data() + rk;
+			T const* const a = c + (rl - rk);
+			T const* const __restrict b = stack.data() + rr;
+
+			// The reciprocal is formed once, in T, so that value types with
+			// their own division (e.g., the quotient rule for Dual) see a single
+			// division per node.
+			// The result has the same nonzeros as `a`.
+			constexpr static int n = tree.footprint(k);
+			T const rb = T(1) / b[0];
+			for (int i = 0; i < n; ++i) {
 				c[i] = a[i] * rb;
 			}
 		}
@@ -160,13 +331,12 @@ namespace ttl
 		{
 			constexpr static exec::Index outer_index = tree.index(k);
 			constexpr static exec::Index all_index = tree.inner_index(k);
-			constexpr static exec::Index tensor_index = tree.tensor_index(k);
 
 			constexpr static int const* ids = tree.scalar_ids(k);
 			constexpr static int rk = tree.stack_offset(k);
 
 			// not constexpr addresses, see class note about multithreading
-			T* const __restrict c = stack + rk;
+			T* const __restrict c = stack.data() + rk;
 
 			// Don't know the state of the stack but we're going to need to accumulate
 			// there so we need to zero it first (it's nearly certainly dirty, either
@@ -175,28 +345,45 @@ namespace ttl
 				c[ii] = T();
 			}
 
+			// The scalar ids are stored in the order that we enumerate the `all`
+			// index space, so self-contractions (e.g., `A(i,i)`) just sum the
+			// diagonal ids into the outer index.
 			constexpr static int M = all_index.size();
 			constexpr static std::array c_map = exec::make_map<N, M>(all_index, outer_index);
-			constexpr static std::array id_map = exec::make_map<N, M>(all_index, tensor_index);
 
 			for (unsigned ii = 0; ii < c_map.size(); ++ii) {
-				c[c_map[ii]] += scalars(ids[id_map[ii]], i);
+				c[c_map[ii]] += scalars(ids[ii], i);
 			}
 		}
 
 		template <int k>
 		void eval_constant(Stack& stack, auto const& constants) const
 		{
+			constexpr static exec::Index outer_index = tree.index(k);
+			constexpr static exec::Index all_index = tree.inner_index(k);
+
 			constexpr static int const* ids = tree.scalar_ids(k);
 			constexpr static int const* end = tree.scalar_ids(k + 1);
 			constexpr static int M = end - ids;
 
 			static constexpr int rk = tree.stack_offset(k);
 
-			T* __restrict c = stack + rk;
+			T* __restrict c = stack.data() + rk;
 
-			for (int i = 0; i < M; ++i) {
-				c[i] = constants(ids[i]);
+			if constexpr (all_index == outer_index) {
+				for (int i = 0; i < M; ++i) {
+					c[i] = constants(ids[i]);
+				}
+			} else {
+				// A self-contraction, sum the diagonal (see eval_scalar).
+				for (int i = 0; i < ttl::pow(N, outer_index.size()); ++i) {
+					c[i] = T();
+				}
+
+				constexpr static std::array c_map = exec::make_map<N, all_index.size()>(all_index, outer_index);
+				for (int i = 0; i < M; ++i) {
+					c[c_map[i]] += constants(ids[i]);
+				}
 			}
 		}
 
@@ -204,12 +391,12 @@ namespace ttl
 		void eval_delta(Stack& stack) const
 		{
 			static constexpr int rk = tree.stack_offset(k);
-			T* __restrict c = stack + rk;
+			T* __restrict c = stack.data() + rk;
 
+			// Only the diagonal is stored.
+			static_assert(tree.footprint(k) == N);
 			for (int i = 0; i < N; ++i) {
-				for (int j = 0; j < N; ++j) {
-					c[i * N + j] = T(i == j);
-				}
+				c[i] = T(1);
 			}
 		}
 
@@ -242,12 +429,51 @@ namespace ttl
 			}
 		}
 
-		void evaluate(auto const& scalars, auto const& constants) const
+		/// Evaluate the tree for the point `i`.
+		///
+		/// The `stack` is just scratch space, it doesn't need to be initialized and
+		/// can be reused across points. After the call the elements of the result
+		/// of the tree can be read with `result(stack, c)`.
+		void evaluate(int i, Stack& stack, auto const& scalars, auto const& constants) const
+		{
+			[&]<std::size_t... k>(std::index_sequence<k...>) {
+				(eval_kernel_step<k>(i, stack, scalars, constants), ...);
+			}(std::make_index_sequence<shape.n_nodes>());
+		}
+
+		/// Evaluate the tree for the point `i`, timing each node.
+		///
+		/// The cycles spent in node `k` are passed to `record(k, cycles)` (see
+		/// ttl::profile).
+		void evaluate(int i, Stack& stack, auto const& scalars, auto const& constants, auto&& record) const
 		{
-			Stack stack {};
-			[&]<std::size_t... i>(std::index_sequence<i...>) {
-				(eval_kernel_step<i>(0, stack, scalars, constants), ...);
+			[&]<std::size_t... k>(std::index_sequence<k...>) {
+				([&] {
+					std::uint64_t t = profile::clock();
+					eval_kernel_step<k>(i, stack, scalars, constants);
+					record(int(k), profile::clock() - t);
+				}(),
+					...);
 			}(std::make_index_sequence<shape.n_nodes>());
 		}
+
+		/// The position of each element of the root's tensor in its stack slot,
+		/// or -1 for the structural zeros.
+		constexpr static std::array result_positions = [] {
+			constexpr int root = shape.n_nodes - 1;
+			std::array<int, ttl::pow(N, tree.index(root).size())> out;
+			for (int c = 0; c < int(out.size()); ++c) {
+				out[c] = tree.position(root, c);
+			}
+			return out;
+		}();
+
+		/// The element at the row-major offset `c` of the root's tensor in an
+		/// evaluated stack.
+		auto result(Stack const& stack, int c) const -> T
+		{
+			int p = result_positions[c];
+			return (p < 0) ? T() : stack[tree.stack_offset(shape.n_nodes - 1) + p];
+		}
 	};
 }
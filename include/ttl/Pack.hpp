@@ -0,0 +1,111 @@
+#pragma once
+
+#include <bit>
+#include <concepts>
+
+namespace ttl
+{
+	/// A pack of `W` lanes of `T` that are evaluated in lock-step.
+	///
+	/// This is used as the value type of an ExecutableTree in order to evaluate
+	/// W points at once. Every point runs the same straight-line code, so all of
+	/// the operations are simple lane-wise loops that the compiler can turn into
+	/// vector instructions for the target (e.g., W = 4 or 8 doubles for AVX2 or
+	/// AVX-512).
+	///
+	/// The pack is aligned to its size, rounded up to a power of two so that
+	/// widths like W = 3 are still valid.
+	template <class T, int W>
+	struct alignas(std::bit_ceil(W * sizeof(T))) Pack {
+		T data[W];
+
+		constexpr Pack()
+			: data {}
+		{
+		}
+
+		/// Broadcast a value to all of the lanes.
+		constexpr Pack(std::convertible_to<T> auto x)
+		{
+			for (int l = 0; l < W; ++l) {
+				data[l] = T(x);
+			}
+		}
+
+		constexpr auto operator[](int l) const -> T const&
+		{
+			return data[l];
+		}
+
+		constexpr auto operator[](int l) -> T&
+		{
+			return data[l];
+		}
+
+		constexpr static auto size() -> int
+		{
+			return W;
+		}
+
+		constexpr friend auto operator-(Pack const& a) -> Pack
+		{
+			Pack out;
+			for (int l = 0; l < W; ++l) {
+				out[l] = -a[l];
+			}
+			return out;
+		}
+
+		constexpr friend auto operator+=(Pack& a, Pack const& b) -> Pack&
+		{
+			for (int l = 0; l < W; ++l) {
+				a[l] += b[l];
+			}
+			return a;
+		}
+
+		constexpr friend auto operator-=(Pack& a, Pack const& b) -> Pack&
+		{
+			for (int l = 0; l < W; ++l) {
+				a[l] -= b[l];
+			}
+			return a;
+		}
+
+		constexpr friend auto operator*=(Pack& a, Pack const& b) -> Pack&
+		{
+			for (int l = 0; l < W; ++l) {
+				a[l] *= b[l];
+			}
+			return a;
+		}
+
+		constexpr friend auto operator/=(Pack& a, Pack const& b) -> Pack&
+		{
+			for (int l = 0; l < W; ++l) {
+				a[l] /= b[l];
+			}
+			return a;
+		}
+
+		constexpr friend auto operator+(Pack a, Pack const& b) -> Pack
+		{
+			return a += b;
+		}
+
+		constexpr friend auto operator-(Pack a, Pack const& b) -> Pack
+		{
+			return a -= b;
+		}
+
+		constexpr friend auto operator*(Pack a, Pack const& b) -> Pack
+		{
+			return a *= b;
+		}
+
+		constexpr friend auto operator/(Pack a, Pack const& b) -> Pack
+		{
+			return a /= b;
+		}
+	};
+}
@@ -17,14 +17,13 @@ namespace ttl
 		{
 		}
 
+		/// Create a rational in lowest terms, with a positive denominator.
 		constexpr Rational(std::ptrdiff_t p, std::ptrdiff_t q)
-			: p(p)
-			, q(q)
 		{
 			assert(q != 0);
-			auto d = std::gcd(p, q);
-			p /= d;
-			q /= d;
+			auto d = (q < 0) ? -std::gcd(p, q) : std::gcd(p, q);
+			this->p = p / d;
+			this->q = q / d;
 		}
 
 		constexpr auto inverse() const -> Rational
@@ -32,6 +31,11 @@ namespace ttl
 			return { q, p };
 		}
 
+		constexpr bool is_negative() const
+		{
+			return p < 0;
+		}
+
 		constexpr friend auto operator+(Rational const& a) -> Rational
 		{
 			return a;
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "ttl/ThreadPool.hpp"
+#include <array>
+#include <cassert>
+#include <concepts>
+#include <utility>
+#include <vector>
+
+namespace ttl::rk
+{
+	/// The explicit schemes that RungeKutta implements.
+	///
+	/// The number of registers is the number of copies of the state that the
+	/// scheme keeps, including the state itself. A stage can never write into
+	/// the register that it reads, because the scalars accessor may read the
+	/// neighbors of a point (e.g., through a ttl::Stencil).
+
+	/// First order, 2 registers.
+	///
+	/// The increment is written to the second register, and added to the state
+	/// in a streaming pass.
+	struct Euler {
+		constexpr static int registers = 2;
+	};
+
+	/// Third order strong stability preserving, in Shu-Osher form, 3
+	/// registers.
+	struct SSPRK3 {
+		constexpr static int registers = 3;
+	};
+
+	/// The classical fourth order scheme, 4 registers.
+	struct RK4 {
+		constexpr static int registers = 4;
+	};
+
+	/// Carpenter and Kennedy's five stage, fourth order, 2N-storage scheme, 2
+	/// registers.
+	///
+	/// Each stage computes `du = A[s] * du + dt * f(u)`, which is fused into the
+	/// evaluation, followed by a streaming pass for `u += B[s] * du`.
+	struct LSRK54 {
+		constexpr static int registers = 2;
+
+		constexpr static std::array<double, 5> A = {
+			0.0,
+			-567301805773.0 / 1357537059087.0,
+			-2404267990393.0 / 2016746695238.0,
+			-3550918686646.0 / 2091501179385.0,
+			-1275806237668.0 / 842570457699.0
+		};
+
+		constexpr static std::array<double, 5> B = {
+			1432997174477.0 / 9575080441755.0,
+			5161836677717.0 / 13612068292357.0,
+			1720146321549.0 / 2090206949498.0,
+			3134564353537.0 / 4481467310338.0,
+			2277821191437.0 / 14882151754819.0
+		};
+	};
+}
+
+namespace ttl
+{
+	/// Integrates the system `Executable` in time with an explicit Runge-Kutta
+	/// `Scheme` (see ttl::rk).
+	///
+	/// The integrator owns the state and the stage registers, which store the
+	/// left-hand-side components of the system for `n` points, one contiguous
+	/// array per component. Each stage is a single evaluation of the system
+	/// over [begin, end), and the combination of the stages is done by the
+	/// update policy as each right-hand-side is written.
+	///
+	/// The rest of the scalars (e.g., the derivatives of the state) depend on
+	/// the stage, so step() is passed a factory, `scalars(u)`, which is called
+	/// once before each stage with an accessor `u(id, i)` for the stage's input,
+	/// and returns the scalars accessor for the stage. Points outside of
+	/// [begin, end) are not updated, so the factory is also where the halo
+	/// points of `u` get their boundary values.
+	template <class Executable, class Scheme>
+	class RungeKutta {
+		using T = typename Executable::value_type;
+
+		constexpr static Executable system = {};
+		constexpr static int M = system.outputs.size();
+		constexpr static int R = Scheme::registers;
+
+		/// The component of the state for each scalar id, or -1.
+		constexpr static std::array slots = [] {
+			std::array<int, system.n_scalars> out;
+			out.fill(-1);
+			for (int c = 0; c < M; ++c) {
+				out[system.outputs[c]] = c;
+			}
+			return out;
+		}();
+
+	public:
+		T time = 0;
+
+		/// Parallelizes the stages when it is set.
+		ThreadPool* pool = nullptr;
+
+		/// Create an integrator for `n` points that updates [begin, end).
+		RungeKutta(int n, int begin, int end)
+			: n_(n)
+			, begin_(begin)
+			, end_(end)
+		{
+			assert(0 <= begin && begin <= end && end <= n);
+			for (std::vector<T>& r : registers_) {
+				r.resize(std::size_t(M) * n);
+			}
+		}
+
+		RungeKutta(int n)
+			: RungeKutta(n, 0, n)
+		{
+		}
+
+		/// The state component `id` (a left-hand-side scalar id) at point `i`.
+		auto state(int id, int i) -> T&
+		{
+			return register_(0)(id, i);
+		}
+
+		auto state(int id, int i) const -> T const&
+		{
+			assert(0 <= slots[id]);
+			return registers_[0][std::size_t(slots[id]) * n_ + i];
+		}
+
+		/// Advance the state by `dt`.
+		void step(T dt, auto&& scalars, auto const& constants)
+		{
+			if constexpr (std::same_as<Scheme, rk::Euler>) {
+				// Swapping the registers would lose the halo of the state.
+				stage(0, 1, scalars, constants, [&](auto& out, auto const& rhs, int, int) {
+					out = dt * rhs;
+				});
+				axpy(1, 1, 0);
+			} else if constexpr (std::same_as<Scheme, rk::SSPRK3>) {
+				auto u = register_(0);
+				auto u1 = register_(1);
+				auto u2 = register_(2);
+				stage(0, 1, scalars, constants, [&](auto& out, auto const& rhs, int id, int i) {
+					out = u(id, i) + dt * rhs;
+				});
+				stage(1, 2, scalars, constants, [&](auto& out, auto const& rhs, int id, int i) {
+					out = T(3) / 4 * u(id, i) + T(1) / 4 * (u1(id, i) + dt * rhs);
+				});
+				// The last stage reads u2, so it can write the state in place.
+				stage(2, 0, scalars, constants, [&](auto& out, auto const& rhs, int id, int i) {
+					out = T(1) / 3 * out + T(2) / 3 * (u2(id, i) + dt * rhs);
+				});
+			} else if constexpr (std::same_as<Scheme, rk::RK4>) {
+				// Register 1 accumulates the result while registers 2 and 3 hold
+				// the inputs of alternate stages.
+				auto u = register_(0);
+				auto x = register_(2);
+				auto y = register_(3);
+				stage(0, 1, scalars, constants, [&](auto& out, auto const& rhs, int id, int i) {
+					out = u(id, i) + dt / 6 * rhs;
+					y(id, i) = u(id, i) + dt / 2 * rhs;
+				});
+				stage(3, 1, scalars, constants, [&](auto& out, auto const& rhs, int id, int i) {
+					out += dt / 3 * rhs;
+					x(id, i) = u(id, i) + dt / 2 * rhs;
+				});
+				stage(2, 1, scalars, constants, [&](auto& out, auto const& rhs, int id, int i) {
+					out += dt / 3 * rhs;
+					y(id, i) = u(id, i) + dt * rhs;
+				});
+				auto acc = register_(1);
+				stage(3, 0, scalars, constants, [&](auto& out, auto const& rhs, int id, int i) {
+					out = acc(id, i) + dt / 6 * rhs;
+				});
+			} else if constexpr (std::same_as<Scheme, rk::LSRK54>) {
+				for (int s = 0; s < int(Scheme::A.size()); ++s) {
+					T a = Scheme::A[s];
+					stage(0, 1, scalars, constants, [&](auto& out, auto const& rhs, int, int) {
+						// The first stage ignores du, which may not be finite.
+						out = (s) ? a * out + dt * rhs : dt * rhs;
+					});
+					axpy(T(Scheme::B[s]), 1, 0);
+				}
+			} else {
+				static_assert(false, "unknown Runge-Kutta scheme");
+			}
+
+			time += dt;
+		}
+
+	private:
+		int n_;
+		int begin_;
+		int end_;
+		std::array<std::vector<T>, R> registers_;
+		typename Executable::Workspaces workspaces_; //!< reused by every parallel stage
+
+		/// An accessor for the register `r`, by left-hand-side scalar id.
+		auto register_(int r)
+		{
+			return [this, r](int id, int i) -> T& {
+				assert(0 <= slots[id]);
+				return registers_[r][std::size_t(slots[id]) * n_ + i];
+			};
+		}
+
+		/// Evaluate the right-hand-side of register `in`, and combine it into
+		/// register `out` with the `update`.
+		void stage(int in, int out, auto&& scalars, auto const& constants, auto const& update)
+		{
+			assert(in != out);
+			auto s = scalars(register_(in));
+			if (pool) {
+				system.evaluate(*pool, begin_, end_, workspaces_, s, constants, register_(out), update);
+			} else {
+				system.evaluate(begin_, end_, s, constants, register_(out), update);
+			}
+		}
+
+		/// Add `b` times register `x` to register `y`, for [begin, end).
+		void axpy(T b, int x, int y)
+		{
+			auto pass = [&](int, int begin, int end) {
+				for (int c = 0; c < M; ++c) {
+					T const* xc = registers_[x].data() + std::size_t(c) * n_;
+					T* yc = registers_[y].data() + std::size_t(c) * n_;
+					for (int i = begin; i < end; ++i) {
+						yc[i] += b * xc[i];
+					}
+				}
+			};
+
+			if (pool) {
+				pool->parallel_for(begin_, end_, pass);
+			} else {
+				pass(0, begin_, end_);
+			}
+		}
+	};
+}
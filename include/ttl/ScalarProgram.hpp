@@ -0,0 +1,443 @@
+#pragma once
+
+#include "ttl/exec.hpp"
+#include "ttl/set.hpp"
+#include <algorithm>
+#include <array>
+#include <compare>
+#include <concepts>
+#include <format>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ttl
+{
+	/// A single scalar operation in a straight-line program.
+	///
+	/// Binary operations refer to their operands by the position of the
+	/// operation that computes them. SCALAR and CONSTANT operations load the
+	/// scalar or constant with the id `a`, and IMMEDIATE operations produce `d`.
+	struct ScalarOp {
+		exec::Tag tag = exec::IMMEDIATE;
+		int a = -1;
+		int b = -1;
+		double d = 0;
+
+		constexpr friend bool operator==(ScalarOp const&, ScalarOp const&) = default;
+		constexpr friend auto operator<=>(ScalarOp const&, ScalarOp const&) = default;
+	};
+
+	/// Builds a straight-line program by evaluating serialized trees with
+	/// symbolic values.
+	///
+	/// The trees are run through SerializedTree::interpret() with Value as the
+	/// value type, which expands every tensor operation into the operations on
+	/// its components for a fixed N. Along the way the operations on immediates
+	/// are folded, operations with structural zeros and ones (e.g., the
+	/// off-diagonal components of a delta) are pruned, and identical
+	/// operations are numbered once.
+	struct ScalarProgramBuilder {
+		set<ScalarOp> ops; //!< the operations, in dependency order
+
+		struct Value {
+			ScalarProgramBuilder* builder = nullptr;
+			int id = -1; //!< the operation that computes the value, or -1
+			double d = 0; //!< the value when it is an immediate
+
+			constexpr Value() = default;
+
+			constexpr Value(std::floating_point auto d)
+				: d(d)
+			{
+			}
+
+			constexpr Value(std::integral auto i)
+				: d(i)
+			{
+			}
+
+			constexpr Value(ScalarProgramBuilder* builder, int id)
+				: builder(builder)
+				, id(id)
+			{
+			}
+
+			constexpr bool is_immediate() const
+			{
+				return id < 0;
+			}
+
+			constexpr bool is(double x) const
+			{
+				return is_immediate() && d == x;
+			}
+
+			constexpr friend auto operator+(Value const& a, Value const& b) -> Value
+			{
+				if (a.is(0)) return b;
+				if (b.is(0)) return a;
+				if (a.is_immediate() && b.is_immediate()) return a.d + b.d;
+				return emit(exec::SUM, a, b);
+			}
+
+			constexpr friend auto operator-(Value const& a, Value const& b) -> Value
+			{
+				if (b.is(0)) return a;
+				if (a.is_immediate() && b.is_immediate()) return a.d - b.d;
+				if (a.id == b.id) return 0;
+				return emit(exec::DIFFERENCE, a, b);
+			}
+
+			constexpr friend auto operator*(Value const& a, Value const& b) -> Value
+			{
+				if (a.is(0) || b.is(0)) return 0;
+				if (a.is(1)) return b;
+				if (b.is(1)) return a;
+				if (a.is_immediate() && b.is_immediate()) return a.d * b.d;
+				return emit(exec::PRODUCT, a, b);
+			}
+
+			/// Division is a product with the reciprocal, as in
+			/// ExecutableTree::eval_ratio(), so that the reciprocal is only
+			/// computed once for all of the components it divides.
+			constexpr friend auto operator/(Value const& a, Value const& b) -> Value
+			{
+				assert(!b.is(0));
+				if (a.is(0)) return 0;
+				if (b.is(1)) return a;
+				if (a.is_immediate() && b.is_immediate()) return a.d / b.d;
+				if (b.is_immediate()) return a * (1.0 / b.d);
+				return a * emit(exec::RATIO, 1, b);
+			}
+
+			constexpr friend auto operator+=(Value& a, Value const& b) -> Value&
+			{
+				return a = a + b;
+			}
+
+			/// Append the operation `a tag b`, or find an identical one.
+			constexpr friend auto emit(exec::Tag tag, Value const& a, Value const& b) -> Value
+			{
+				ScalarProgramBuilder* builder = (a.builder) ? a.builder : b.builder;
+				assert(builder);
+				int ia = builder->operand(a);
+				int ib = builder->operand(b);
+				if ((tag == exec::SUM || tag == exec::PRODUCT) && ib < ia) {
+					std::swap(ia, ib);
+				}
+				return Value(builder, builder->intern({ .tag = tag, .a = ia, .b = ib }));
+			}
+		};
+
+		/// The position of `op`, which is appended if it is new.
+		constexpr auto intern(ScalarOp const& op) -> int
+		{
+			if (auto i = ops.find(op)) {
+				return *i;
+			}
+			ops.emplace(op);
+			return ops.size() - 1;
+		}
+
+		/// The position of the operation that computes `v`.
+		constexpr auto operand(Value const& v) -> int
+		{
+			return (v.is_immediate()) ? intern({ .tag = exec::IMMEDIATE, .d = v.d }) : v.id;
+		}
+
+		/// Load the scalar or constant with the id `id`.
+		constexpr auto load(exec::Tag tag, int id) -> Value
+		{
+			assert(tag == exec::SCALAR || tag == exec::CONSTANT);
+			return Value(this, intern({ .tag = tag, .a = id }));
+		}
+
+		/// The value that operation `k` computes, which is an immediate for
+		/// IMMEDIATE operations so that it still folds.
+		constexpr auto value(int k) -> Value
+		{
+			return (ops[k].tag == exec::IMMEDIATE) ? Value(ops[k].d) : Value(this, k);
+		}
+
+		/// A sparse gradient, as (scalar id, derivative) pairs sorted by id.
+		using Gradient = std::vector<std::pair<int, Value>>;
+
+		/// Compute `sx * x + sy * y`, dropping the entries that fold to zero.
+		constexpr static auto combine(Value const& sx, Gradient const& x, Value const& sy, Gradient const& y) -> Gradient
+		{
+			auto term = [](Value const& s, Value const& v) -> Value {
+				return (s.is(-1)) ? 0 - v : s * v;
+			};
+
+			Gradient out;
+			auto i = x.begin();
+			auto j = y.begin();
+			while (i != x.end() || j != y.end()) {
+				int id;
+				Value v;
+				if (j == y.end() || (i != x.end() && i->first < j->first)) {
+					id = i->first;
+					v = term(sx, i->second);
+					++i;
+				} else if (i == x.end() || j->first < i->first) {
+					id = j->first;
+					v = term(sy, j->second);
+					++j;
+				} else {
+					id = i->first;
+					v = (sy.is(-1)) ? sx * i->second - j->second : sx * i->second + sy * j->second;
+					++i;
+					++j;
+				}
+				if (!v.is(0)) {
+					out.emplace_back(id, v);
+				}
+			}
+			return out;
+		}
+
+		/// Differentiate the first `n` operations with respect to the scalars
+		/// that they load.
+		///
+		/// The derivatives are built with Value arithmetic, so they are folded
+		/// and pruned as they are emitted, and derivatives that are structurally
+		/// zero never appear in the gradients. The operations for the
+		/// derivatives are appended after the first `n`.
+		constexpr auto differentiate(int n) -> std::vector<Gradient>
+		{
+			std::vector<Gradient> d(n);
+			for (int k = 0; k < n; ++k) {
+				// Copy the operation, emitting derivatives can grow the set.
+				ScalarOp const op = ops[k];
+				switch (op.tag) {
+				case exec::SCALAR:
+					d[k] = { { op.a, Value(1) } };
+					break;
+				case exec::SUM:
+					d[k] = combine(1, d[op.a], 1, d[op.b]);
+					break;
+				case exec::DIFFERENCE:
+					d[k] = combine(1, d[op.a], -1, d[op.b]);
+					break;
+				case exec::PRODUCT:
+					// (ab)' = b a' + a b'
+					d[k] = combine(value(op.b), d[op.a], value(op.a), d[op.b]);
+					break;
+				case exec::RATIO: {
+					// (a/b)' = (a' - (a/b) b') / b
+					Value r = 1 / value(op.b);
+					d[k] = combine(r, d[op.a], 0 - value(k) * r, d[op.b]);
+					break;
+				}
+				default:
+					break;
+				}
+			}
+			return d;
+		}
+
+		/// Propagate the adjoints of the first `n` operations back to their
+		/// operands, in reverse order.
+		///
+		/// On entry `adj[k]` is the seed of operation `k`, and on return it is
+		/// its adjoint, i.e., the sum over all of its uses. The adjoints of the
+		/// loads are the derivatives with respect to the loaded values. As with
+		/// differentiate(), the operations for the adjoints are appended after
+		/// the first `n`.
+		constexpr void reverse(int n, std::vector<Value>& adj)
+		{
+			for (int k = n - 1; k >= 0; --k) {
+				if (adj[k].is(0)) {
+					continue;
+				}
+
+				ScalarOp const op = ops[k];
+				Value const a = adj[k];
+				switch (op.tag) {
+				case exec::SUM:
+					adj[op.a] += a;
+					adj[op.b] += a;
+					break;
+				case exec::DIFFERENCE:
+					adj[op.a] += a;
+					adj[op.b] = adj[op.b] - a;
+					break;
+				case exec::PRODUCT:
+					adj[op.a] += a * value(op.b);
+					adj[op.b] += a * value(op.a);
+					break;
+				case exec::RATIO: {
+					Value r = 1 / value(op.b);
+					adj[op.a] += a * r;
+					adj[op.b] = adj[op.b] - a * value(k) * r;
+					break;
+				}
+				default:
+					break;
+				}
+			}
+		}
+
+		/// Remove the operations that don't contribute to the `outputs`.
+		///
+		/// The `outputs` are the positions of the operations that compute each
+		/// output, they are renumbered to match the returned operations.
+		constexpr auto compile(std::vector<int>& outputs) const -> std::vector<ScalarOp>
+		{
+			int n = ops.size();
+			std::vector<char> live(n, false);
+			for (int o : outputs) {
+				live[o] = true;
+			}
+
+			// Operations always come after their operands.
+			for (int k = n - 1; k >= 0; --k) {
+				if (live[k] && exec::is_binary(ops[k].tag)) {
+					live[ops[k].a] = true;
+					live[ops[k].b] = true;
+				}
+			}
+
+			std::vector<int> id(n, -1);
+			std::vector<ScalarOp> out;
+			for (int k = 0; k < n; ++k) {
+				if (live[k]) {
+					ScalarOp op = ops[k];
+					if (exec::is_binary(op.tag)) {
+						op.a = id[op.a];
+						op.b = id[op.b];
+					}
+					id[k] = out.size();
+					out.push_back(op);
+				}
+			}
+
+			for (int& o : outputs) {
+				o = id[o];
+			}
+
+			return out;
+		}
+	};
+
+	/// A straight-line program of `M` scalar operations that computes `O`
+	/// outputs.
+	template <int M, int O>
+	struct ScalarProgram {
+		std::array<ScalarOp, M> ops;
+		std::array<int, O> outputs; //!< the operation that computes each output
+
+		constexpr ScalarProgram(std::vector<ScalarOp> const& ops, std::vector<int> const& outputs)
+		{
+			assert(ops.size() == M);
+			assert(outputs.size() == O);
+			std::copy(ops.begin(), ops.end(), this->ops.begin());
+			std::copy(outputs.begin(), outputs.end(), this->outputs.begin());
+		}
+
+		/// Print the program, one operation per line, using the names of the
+		/// scalars and constants.
+		auto to_string(auto const& scalars, auto const& constants) const -> std::string
+		{
+			std::string out;
+			for (int k = 0; k < M; ++k) {
+				ScalarOp const& op = ops[k];
+				switch (op.tag) {
+				case exec::SUM:
+					out += std::format("r{} = r{} + r{}\n", k, op.a, op.b);
+					break;
+				case exec::DIFFERENCE:
+					out += std::format("r{} = r{} - r{}\n", k, op.a, op.b);
+					break;
+				case exec::PRODUCT:
+					out += std::format("r{} = r{} * r{}\n", k, op.a, op.b);
+					break;
+				case exec::RATIO:
+					out += std::format("r{} = r{} / r{}\n", k, op.a, op.b);
+					break;
+				case exec::IMMEDIATE:
+					out += std::format("r{} = {}\n", k, op.d);
+					break;
+				case exec::SCALAR:
+					out += std::format("r{} = {}\n", k, scalars[op.a]);
+					break;
+				case exec::CONSTANT:
+					out += std::format("r{} = {}\n", k, constants[op.a]);
+					break;
+				default:
+					assert(false);
+				}
+			}
+			for (int c = 0; c < O; ++c) {
+				out += std::format("out{} = r{}\n", c, outputs[c]);
+			}
+			return out;
+		}
+	};
+
+	/// Evaluates a ScalarProgram as straight-line code.
+	///
+	/// Every operand position is a compile-time constant, so the values are
+	/// named locals rather than slots in a stack that is indexed by loops, and
+	/// the compiler is free to keep them all in registers. The kernel can also
+	/// be evaluated in a constant expression, which the tests use to check the
+	/// generated programs.
+	template <class T, auto program>
+	struct ScalarKernel {
+		constexpr static int M = program.ops.size();
+		constexpr static int O = program.outputs.size();
+
+		/// The number of operations that are expanded by each fold expression,
+		/// this keeps the folds below the compilers' expression nesting limits.
+		constexpr static int B = 128;
+
+		using Registers = std::array<T, M>;
+
+		template <int k>
+		constexpr static auto eval_op(Registers const& r, int i, auto const& scalars, auto const& constants) -> T
+		{
+			constexpr ScalarOp op = program.ops[k];
+			if constexpr (op.tag == exec::SUM) {
+				return r[op.a] + r[op.b];
+			} else if constexpr (op.tag == exec::DIFFERENCE) {
+				return r[op.a] - r[op.b];
+			} else if constexpr (op.tag == exec::PRODUCT) {
+				return r[op.a] * r[op.b];
+			} else if constexpr (op.tag == exec::RATIO) {
+				return r[op.a] / r[op.b];
+			} else if constexpr (op.tag == exec::IMMEDIATE) {
+				return T(op.d);
+			} else if constexpr (op.tag == exec::SCALAR) {
+				return T(scalars(op.a, i));
+			} else if constexpr (op.tag == exec::CONSTANT) {
+				return T(constants(op.a));
+			} else {
+				static_assert(false);
+			}
+		}
+
+		template <int b>
+		constexpr static void eval_block(Registers& r, int i, auto const& scalars, auto const& constants)
+		{
+			constexpr int e = std::min(M, b + B);
+			[&]<std::size_t... k>(std::index_sequence<k...>) {
+				((r[b + k] = eval_op<b + k>(r, i, scalars, constants)), ...);
+			}(std::make_index_sequence<e - b>());
+		}
+
+		/// Evaluate the program for the point `i`, and call `write(c, value)`
+		/// for each output `c`.
+		constexpr void evaluate(int i, auto const& scalars, auto const& constants, auto&& write) const
+		{
+			Registers r;
+			[&]<std::size_t... b>(std::index_sequence<b...>) {
+				(eval_block<b * B>(r, i, scalars, constants), ...);
+			}(std::make_index_sequence<(M + B - 1) / B>());
+
+			[&]<std::size_t... c>(std::index_sequence<c...>) {
+				(write(int(c), r[program.outputs[c]]), ...);
+			}(std::make_index_sequence<O>());
+		}
+	};
+}
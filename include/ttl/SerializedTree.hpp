@@ -1,14 +1,18 @@
 #pragma once
 
 #include "ttl/Scalar.hpp"
+#include "ttl/StackAllocator.hpp"
 #include "ttl/Tag.hpp"
 #include "ttl/TensorTree.hpp"
 #include "ttl/TreeShape.hpp"
 #include "ttl/exec.hpp"
+#include "ttl/pow.hpp"
 #include "ttl/set.hpp"
+#include <algorithm>
 #include <array>
 #include <format>
 #include <print>
+#include <string>
 #include <vector>
 
 namespace ttl
@@ -29,11 +33,13 @@ namespace ttl
 		std::array<int, shape.n_scalars> scalar_ids_; //!< scalar ids for tensors
 		std::array<double, shape.n_immediates> immediates_; //!< just double in gcc-11
 		std::array<char, shape.n_tensor_ids> tensor_ids_;
+		std::array<bool, shape.n_pattern> nonzeros_; //!< structural nonzeros of each node
 
 		// Per-node state.
 		std::array<exec::Tag, shape.n_nodes> tags; //!< type of each node
 		std::array<int, shape.n_nodes> rvo_; //!< return stack slot
 		std::array<int, shape.n_nodes> left_; //!< index of left child (if any)
+		std::array<int, shape.n_nodes> right_; //!< index of right child (if any)
 		std::array<int, shape.n_nodes> order_; //!< tensor order (if any)
 
 		// Per-node offsets into the compressed data.
@@ -43,15 +49,21 @@ namespace ttl
 		std::array<int, shape.n_nodes + 1> scalar_ids_offsets_;
 		std::array<int, shape.n_nodes + 1> immediate_offsets_;
 		std::array<int, shape.n_nodes + 1> tensor_ids_offsets_;
+		std::array<int, shape.n_nodes + 1> nonzeros_offsets_;
 
 		/// Create a serialized tree from a tensor tree
+		///
+		/// Scalar ids are positions in the `scalars` set. Components of the
+		/// compiler-generated temporaries are numbered after the scalars, i.e.,
+		/// their id is `scalars.size()` plus their position in `temporaries`.
 		constexpr SerializedTree(TensorTree const& tree,
 			set<Scalar> const& scalars,
-			set<Scalar> const& constants)
+			set<Scalar> const& constants,
+			set<Scalar> const& temporaries = {})
 		{
 			{
-				Builder_ builder(*this);
-				builder.map(tree.root(), scalars, constants);
+				Builder_ builder(*this, scalars, constants, temporaries);
+				builder.map(tree.root());
 			}
 
 			// Just some extra checks for the tree integrity... don't really think any
@@ -64,13 +76,16 @@ namespace ttl
 				assert(scalar_ids_offsets_[i] <= scalar_ids_offsets_[i + 1]);
 				assert(immediate_offsets_[i] <= immediate_offsets_[i + 1]);
 				assert(tensor_ids_offsets_[i] <= tensor_ids_offsets_[i + 1]);
+				assert(nonzeros_offsets_[i] < nonzeros_offsets_[i + 1]);
 
+				assert(0 <= rvo_[i]);
+				assert(rvo_[i] < shape.stack_depth);
 				if (is_binary(tags[i])) {
-					assert(left_[i] < i - 1);
-					assert(0 <= rvo_[i]);
-					assert(rvo_[i] < rvo_[left_[i]]);
-					assert(rvo_[left_[i]] < rvo_[i - 1]);
-					assert(rvo_[i - 1] <= shape.stack_depth);
+					assert(left_[i] < i);
+					assert(right_[i] < i);
+					assert(left_[i] == i - 1 || right_[i] == i - 1);
+					assert(rvo_[left_[i]] != rvo_[right_[i]]);
+					assert(rvo_[i] != rvo_[right_[i]]);
 				}
 			}
 		}
@@ -82,30 +97,30 @@ namespace ttl
 
 		constexpr int right(int k) const
 		{
-			return k - 1;
+			return right_[k];
 		}
 
 		constexpr exec::Index index(int k) const
 		{
 			return exec::Index {
-				.i = &indices_[index_offsets_[k]],
-				.e = &indices_[index_offsets_[k + 1]]
+				.i = indices_.data() + index_offsets_[k],
+				.e = indices_.data() + index_offsets_[k + 1]
 			};
 		}
 
 		constexpr exec::Index inner_index(int k) const
 		{
 			return exec::Index {
-				.i = &inner_indices_[inner_index_offsets_[k]],
-				.e = &inner_indices_[inner_index_offsets_[k + 1]]
+				.i = inner_indices_.data() + inner_index_offsets_[k],
+				.e = inner_indices_.data() + inner_index_offsets_[k + 1]
 			};
 		}
 
 		constexpr exec::Index tensor_index(int k) const
 		{
 			return exec::Index {
-				.i = &tensor_indices_[tensor_index_offsets_[k]],
-				.e = &tensor_indices_[tensor_index_offsets_[k + 1]]
+				.i = tensor_indices_.data() + tensor_index_offsets_[k],
+				.e = tensor_indices_.data() + tensor_index_offsets_[k + 1]
 			};
 		}
 
@@ -116,7 +131,7 @@ namespace ttl
 
 		constexpr int const* scalar_ids(int k) const
 		{
-			return &scalar_ids_[scalar_ids_offsets_[k]];
+			return scalar_ids_.data() + scalar_ids_offsets_[k];
 		}
 
 		constexpr double immediate(int k) const
@@ -124,6 +139,75 @@ namespace ttl
 			return immediates_[immediate_offsets_[k]];
 		}
 
+		/// Check to see if the element at the row-major offset `c` of node `k`'s
+		/// tensor can be nonzero (see TensorTree::Node::nonzeros()).
+		constexpr bool nonzero(int k, int c) const
+		{
+			return nonzeros_[nonzeros_offsets_[k] + c];
+		}
+
+		/// The number of elements of node `k`'s tensor that are stored in its
+		/// stack slot, i.e., its structural nonzeros.
+		constexpr int footprint(int k) const
+		{
+			return std::count(nonzeros_.begin() + nonzeros_offsets_[k], nonzeros_.begin() + nonzeros_offsets_[k + 1], true);
+		}
+
+		/// Check to see if node `k` stores all of the elements of its tensor.
+		constexpr bool is_dense(int k) const
+		{
+			return footprint(k) == nonzeros_offsets_[k + 1] - nonzeros_offsets_[k];
+		}
+
+		/// The position in node `k`'s stack slot of the element at the row-major
+		/// offset `c`, or -1 if the element is a structural zero.
+		///
+		/// A slot stores the nonzeros in row-major order, so a dense node's
+		/// positions are just its offsets.
+		constexpr int position(int k, int c) const
+		{
+			if (!nonzero(k, c)) {
+				return -1;
+			}
+			return std::count(nonzeros_.begin() + nonzeros_offsets_[k], nonzeros_.begin() + nonzeros_offsets_[k] + c, true);
+		}
+
+		/// The number of nonzero products that the product node `k` sums, i.e.,
+		/// the products where both operands can be nonzero.
+		constexpr int n_products(int k) const
+		{
+			assert(tags[k] == exec::PRODUCT);
+			int n = 0;
+			for_each(inner_index(k), index(k), index(left(k)), index(right(k)), [&](int, int a, int b) {
+				n += nonzero(left(k), a) && nonzero(right(k), b);
+			});
+			return n;
+		}
+
+		/// An estimate of the floating point operations that node `k` performs.
+		///
+		/// Only the structural nonzeros are computed (see footprint()).
+		constexpr int flops(int k) const
+		{
+			constexpr int N = shape.dims;
+			int n = ttl::pow(N, index(k).size());
+			int m = ttl::pow(N, inner_index(k).size());
+			switch (tags[k]) {
+			case exec::SUM:
+			case exec::DIFFERENCE:
+				return footprint(k);
+			case exec::PRODUCT:
+				return n_products(k) + (n_products(k) - footprint(k));
+			case exec::RATIO:
+				return footprint(k) + 1;
+			case exec::SCALAR:
+			case exec::CONSTANT:
+				return m - n;
+			default:
+				return 0;
+			}
+		}
+
 		constexpr Tensor tensor(int k) const
 		{
 			assert(tags[k] == exec::CONSTANT || tags[k] == exec::SCALAR);
@@ -134,6 +218,36 @@ namespace ttl
 			return Tensor(id, order_[k]);
 		}
 
+		/// Print the subtree rooted at node `k` as an expression.
+		///
+		/// This uses the same notation as TensorTree::Node::to_string(), except
+		/// that immediates are printed as doubles, so a serialized tree can be
+		/// described without the tensor tree that it came from.
+		auto to_string(int k) const -> std::string
+		{
+			constexpr const char* ops[] = { "+", "-", "*", "/" };
+			switch (tags[k]) {
+			case exec::SUM:
+			case exec::DIFFERENCE:
+			case exec::PRODUCT:
+			case exec::RATIO:
+				return std::format("({} {} {})", to_string(left(k)), ops[tags[k]], to_string(right(k)));
+			case exec::IMMEDIATE:
+				return std::format("{}", immediate(k));
+			case exec::DELTA:
+				return std::format("{}", index(k));
+			case exec::SCALAR:
+			case exec::CONSTANT:
+				if (tensor_index(k).size()) {
+					return std::format("{}({})", tensor(k), tensor_index(k));
+				} else {
+					return std::format("{}", tensor(k));
+				}
+			}
+			assert(false);
+			__builtin_unreachable();
+		}
+
 		constexpr int n_constant_coefficients() const
 		{
 			int n = 0;
@@ -159,9 +273,114 @@ namespace ttl
 			}
 		}
 
+		/// Evaluate a tree that doesn't depend on any scalars.
+		///
+		/// This is a simple interpreter for the serialized tree, rather than the
+		/// specialized kernels in ExecutableTree, so it can be used during
+		/// constant evaluation. It is only meant for trees that are evaluated
+		/// once, like the derived constants.
+		///
+		/// @returns The components of the root, in row-major order.
+		template <class U>
+		constexpr auto interpret(auto const& constants) const -> std::vector<U>
+		{
+			return interpret<U>([](int) -> U {
+				assert(false);
+				return U();
+			}, constants);
+		}
+
+		/// Evaluate a tree with the `scalars(id)` and `constants(id)` accessors.
+		///
+		/// The value type only needs the arithmetic operators, so this is also
+		/// used with symbolic values to scalarize the tree (see ScalarProgram).
+		///
+		/// The interpreter keeps every node's tensor in full rather than in the
+		/// compacted stack slots, but it skips the products of structural zeros
+		/// so that they don't show up in the scalarized program.
+		template <class U>
+		constexpr auto interpret(auto const& scalars, auto const& constants) const -> std::vector<U>
+		{
+			constexpr int N = shape.dims;
+			std::vector<std::vector<U>> values(shape.n_nodes);
+
+			for (int k = 0; k < shape.n_nodes; ++k) {
+				exec::Index ci = index(k);
+				std::vector<U>& c = values[k];
+				c.resize(ttl::pow(N, ci.size()));
+
+				switch (tags[k]) {
+				case exec::SUM:
+				case exec::DIFFERENCE:
+				case exec::PRODUCT:
+				case exec::RATIO: {
+					exec::Tag tag = tags[k];
+					int l = left(k);
+					int r = right(k);
+					std::vector<U> const& a = values[l];
+					std::vector<U> const& b = values[r];
+					exec::Index all = (tag == exec::PRODUCT || tag == exec::RATIO) ? inner_index(k) : ci;
+					for_each(all, ci, index(l), index(r), [&](int i, int j, int m) {
+						if (tag == exec::SUM) c[i] = a[j] + b[m];
+						if (tag == exec::DIFFERENCE) c[i] = a[j] - b[m];
+						if (tag == exec::PRODUCT && nonzero(l, j) && nonzero(r, m)) c[i] += a[j] * b[m];
+						if (tag == exec::RATIO) c[i] = a[j] / b[m];
+					});
+				} break;
+
+				case exec::IMMEDIATE:
+					c[0] = immediate(k);
+					break;
+
+				case exec::CONSTANT: {
+					int const* ids = scalar_ids(k);
+					int n = 0;
+					for_each(inner_index(k), ci, ci, ci, [&](int i, int, int) {
+						c[i] += constants(ids[n++]);
+					});
+				} break;
+
+				case exec::SCALAR: {
+					int const* ids = scalar_ids(k);
+					int n = 0;
+					for_each(inner_index(k), ci, ci, ci, [&](int i, int, int) {
+						c[i] += scalars(ids[n++]);
+					});
+				} break;
+
+				case exec::DELTA:
+					for (int i = 0; i < N; ++i) {
+						c[i * N + i] = U(1);
+					}
+					break;
+
+				default:
+					assert(false);
+				}
+			}
+
+			return std::move(values.back());
+		}
+
+		/// Enumerate the `all` index space and call op(c, a, b) with the
+		/// row-major offsets for each of the indices.
+		constexpr static void for_each(exec::Index all, exec::Index ci, exec::Index ai, exec::Index bi, auto&& op)
+		{
+			constexpr int N = shape.dims;
+			ScalarIndex index(all.size());
+			do {
+				op(index.select(all, ci).row_major(N),
+					index.select(all, ai).row_major(N),
+					index.select(all, bi).row_major(N));
+			} while (index.carry_sum_inc(N));
+		}
+
 		// Variables used during the initialization process.
 		struct Builder_ {
 			SerializedTree& tree;
+			set<Scalar> const& scalars;
+			set<Scalar> const& constants;
+			set<Scalar> const& temporaries;
 
 			int i = 0;
 			int index = 0;
@@ -170,13 +389,18 @@ namespace ttl
 			int tensor = 0;
 			int scalar = 0;
 			int immediate = 0;
-			std::vector<int> stack;
+			int nonzero = 0;
+			StackAllocator stack;
 
-			constexpr Builder_(SerializedTree& tree)
+			constexpr Builder_(SerializedTree& tree,
+				set<Scalar> const& scalars,
+				set<Scalar> const& constants,
+				set<Scalar> const& temporaries)
 				: tree(tree)
+				, scalars(scalars)
+				, constants(constants)
+				, temporaries(temporaries)
 			{
-				stack.reserve(shape.stack_depth + 1);
-				stack.push_back(0);
 			}
 
 			constexpr ~Builder_()
@@ -189,6 +413,7 @@ namespace ttl
 				tree.scalar_ids_offsets_[i] = std::size(tree.scalar_ids_);
 				tree.immediate_offsets_[i] = std::size(tree.immediates_);
 				tree.tensor_ids_offsets_[i] = std::size(tree.tensor_ids_);
+				tree.nonzeros_offsets_[i] = std::size(tree.nonzeros_);
 
 				assert(i == shape.n_nodes);
 				assert(scalar == shape.n_scalars);
@@ -197,7 +422,9 @@ namespace ttl
 				assert(inner_index == shape.n_inner_indices);
 				assert(tensor_index == shape.n_tensor_indices);
 				assert(immediate == shape.n_immediates);
-				assert(stack.size() == 2);
+				assert(nonzero == shape.n_pattern);
+				assert(stack.live.size() == 1);
+				assert(stack.depth == shape.stack_depth);
 			}
 
 			constexpr exec::Tag to_tag(Node const* node)
@@ -226,12 +453,14 @@ namespace ttl
 			}
 
 			/// Record the information associated with a leaf node
-			constexpr void record(Node const* node, int top_of_stack, int left = -1)
+			constexpr void record(Node const* node, int rk, int left = -1, int right = -1)
 			{
-				assert(top_of_stack + node->tensor_size(shape.dims) <= shape.stack_depth);
+				assert(0 < node->footprint(shape.dims));
+				assert(rk + node->footprint(shape.dims) <= shape.stack_depth);
 				tree.tags[i] = to_tag(node);
-				tree.rvo_[i] = top_of_stack;
+				tree.rvo_[i] = rk;
 				tree.left_[i] = left;
+				tree.right_[i] = right;
 				tree.order_[i] = node->order();
 
 				tree.index_offsets_[i] = index;
@@ -240,6 +469,7 @@ namespace ttl
 				tree.scalar_ids_offsets_[i] = scalar;
 				tree.immediate_offsets_[i] = immediate;
 				tree.tensor_ids_offsets_[i] = tensor;
+				tree.nonzeros_offsets_[i] = nonzero;
 
 				// Store my outer index to the right offset.
 				for (char c : node->outer()) {
@@ -250,9 +480,14 @@ namespace ttl
 				for (char c : node->all()) {
 					tree.inner_indices_[inner_index++] = c;
 				}
+
+				// Store my zero pattern.
+				for (bool b : node->nonzeros(shape.dims)) {
+					tree.nonzeros_[nonzero++] = b;
+				}
 			}
 
-			constexpr void map_tensor(Node const* node, set<Scalar> const& scalars, set<Scalar> const& constants)
+			constexpr void map_tensor(Node const* node)
 			{
 				tree.order_[i] = node->tensor.order();
 
@@ -262,10 +497,12 @@ namespace ttl
 						auto i = constants.find(s);
 						assert(i);
 						tree.scalar_ids_[scalar++] = *i;
-					} else {
-						auto i = scalars.find(s);
-						assert(i);
+					} else if (auto i = scalars.find(s)) {
 						tree.scalar_ids_[scalar++] = *i;
+					} else {
+						auto j = temporaries.find(s);
+						assert(j);
+						tree.scalar_ids_[scalar++] = scalars.size() + *j;
 					}
 				});
 
@@ -280,15 +517,8 @@ namespace ttl
 				}
 			}
 
-			constexpr int map(Node const* node, set<Scalar> const& scalars, set<Scalar> const& constants)
+			constexpr int map(Node const* node)
 			{
-				int top_of_stack = stack.back();
-				stack.push_back(top_of_stack + node->tensor_size(shape.dims));
-
-				if (!std::is_constant_evaluated()) {
-					std::print("serialize stack:{}\n", stack.back());
-				}
-
 				switch (node->tag) {
 				case ttl::SUM:
 				case ttl::DIFFERENCE:
@@ -296,35 +526,39 @@ namespace ttl
 				case ttl::RATIO: {
 					assert(node->tag != ttl::RATIO || node->b()->order() == 0);
 
-					int l = map(node->a(), scalars, constants);
-					int r = map(node->b(), scalars, constants);
-					std::ignore = r;
-					assert(l < r);
-					assert(r == i - 1);
+					// Evaluate the child that needs the most stack space first, and
+					// then allocate (or reuse) the result slot. This must match the
+					// allocation order in TensorTree::Node::shape.
+					int l, r;
+					if (node->b_first(shape.dims)) {
+						r = map(node->b());
+						l = map(node->a());
+					} else {
+						l = map(node->a());
+						r = map(node->b());
+					}
 
-					stack.pop_back();
-					stack.pop_back();
-					record(node, top_of_stack, l);
+					int rk = node->allocate(shape.dims, stack, tree.rvo_[l], tree.rvo_[r]);
+					record(node, rk, l, r);
 				} break;
 
 				case ttl::INDEX:
 					assert(node->index.size() == 2);
-					record(node, top_of_stack);
+					record(node, node->allocate(shape.dims, stack));
 					break;
 
 				case ttl::TENSOR:
-					record(node, top_of_stack);
-					map_tensor(node, scalars, constants);
+					record(node, node->allocate(shape.dims, stack));
+					map_tensor(node);
 					break;
 
 				case ttl::RATIONAL:
-					record(node, top_of_stack);
-					;
+					record(node, node->allocate(shape.dims, stack));
 					tree.immediates_[immediate++] = as<T>(node->q);
 					break;
 
 				case ttl::DOUBLE:
-					record(node, top_of_stack);
+					record(node, node->allocate(shape.dims, stack));
 					tree.immediates_[immediate++] = node->d;
 					break;
 
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <vector>
+
+namespace ttl
+{
+	/// A first-fit allocator for the slots in an evaluation stack.
+	///
+	/// The allocator doesn't own any memory, it just hands out offsets into
+	/// the stack and tracks the high-water mark, which is the `stack_depth` that
+	/// the tree needs. Slots are released as soon as the value they hold is dead
+	/// so that later nodes can reuse them.
+	///
+	/// The same sequence of allocate/release calls must be made when computing
+	/// the TreeShape and when serializing the tree, so that the offsets and the
+	/// depth agree.
+	struct StackAllocator {
+		struct Block {
+			int offset;
+			int size;
+		};
+
+		std::vector<Block> live; //!< sorted by offset
+		int depth = 0;
+
+		/// Allocate `size` contiguous slots at the lowest offset that fits.
+		constexpr auto allocate(int size) -> int
+		{
+			int offset = 0;
+			auto i = live.begin();
+			for (; i != live.end(); ++i) {
+				if (offset + size <= i->offset) {
+					break;
+				}
+				offset = i->offset + i->size;
+			}
+			live.insert(i, Block { offset, size });
+			depth = std::max(depth, offset + size);
+			return offset;
+		}
+
+		/// Release a block that was returned by allocate().
+		constexpr void release(int offset)
+		{
+			auto i = std::find_if(live.begin(), live.end(), [&](Block const& b) {
+				return b.offset == offset;
+			});
+			assert(i != live.end());
+			live.erase(i);
+		}
+	};
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include "ttl/Scalar.hpp"
+#include "ttl/set.hpp"
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <type_traits>
+#include <vector>
+
+namespace ttl
+{
+	/// The radius of a centered finite-difference stencil for the `m`th
+	/// derivative that is accurate to order `p`.
+	constexpr auto central_radius(int m, int p) -> int
+	{
+		return (m) ? (m + 1) / 2 + p / 2 - 1 : 0;
+	}
+
+	/// The weights of a centered finite-difference approximation of the `m`th
+	/// derivative that is accurate to order `p`, for the offsets [-r, r] and a
+	/// unit spacing.
+	///
+	/// The weights are computed with Fornberg's algorithm.
+	constexpr auto central_difference(int m, int p) -> std::vector<double>
+	{
+		int r = central_radius(m, p);
+		int n = 2 * r + 1;
+
+		// c[j][k] is the weight of the offset j - r for the kth derivative.
+		std::vector<std::vector<double>> c(n, std::vector<double>(m + 1));
+		c[0][0] = 1;
+
+		double c1 = 1;
+		double c4 = -r;
+		for (int i = 1; i < n; ++i) {
+			int mn = std::min(i, m);
+			double c2 = 1;
+			double c5 = c4;
+			c4 = i - r;
+			for (int j = 0; j < i; ++j) {
+				double c3 = i - j;
+				c2 *= c3;
+				if (j == i - 1) {
+					for (int k = mn; k > 0; --k) {
+						c[i][k] = c1 * (k * c[i - 1][k - 1] - c5 * c[i - 1][k]) / c2;
+					}
+					c[i][0] = -c1 * c5 * c[i - 1][0] / c2;
+				}
+				for (int k = mn; k > 0; --k) {
+					c[j][k] = (c4 * c[j][k] - k * c[j][k - 1]) / c3;
+				}
+				c[j][0] = c4 * c[j][0] / c3;
+			}
+			c1 = c2;
+		}
+
+		std::vector<double> out(n);
+		for (int j = 0; j < n; ++j) {
+			out[j] = c[j][m];
+		}
+		return out;
+	}
+
+	/// Computes the derivative scalars from the primal fields with finite
+	/// differences.
+	///
+	/// The derivative scalars (e.g., `∂vx_∂xy`) would otherwise have to be
+	/// stored by the user, one array per component. Instead, each scalar id is
+	/// mapped to its primal (`vx`) and a stencil that is picked from its α, and
+	/// the stencil is applied to the primal field whenever the scalar is read.
+	/// Mixed derivatives use the tensor product of the one-dimensional
+	/// stencils, and all of the stencils are accurate to order `P`.
+	///
+	/// The points are numbered in row-major order with x varying fastest, on a
+	/// grid that includes a `halo` of points on every side. Only the points
+	/// that are at least `halo` points away from the boundary of the grid can
+	/// be evaluated.
+	template <int N, auto const& scalars, int P = 2>
+	struct Stencil {
+		static_assert(P > 0 && P % 2 == 0, "centered stencils have an even order of accuracy");
+
+		constexpr static int n_scalars = scalars.size();
+
+		/// An offset and its weight, for a unit spacing.
+		struct Tap {
+			std::array<int, N> offset;
+			double weight;
+		};
+
+		constexpr static auto primal(Scalar s) -> Scalar
+		{
+			s.order = 0;
+			s.direction = 0;
+			for (int n = 0; n < s.α.size(); ++n) {
+				s.α[n] = 0;
+			}
+			return s;
+		}
+
+		constexpr static auto make_primals() -> set<Scalar>
+		{
+			set<Scalar> out;
+			for (Scalar const& s : scalars) {
+				out.emplace(primal(s));
+			}
+			return out;
+		}
+
+		constexpr static auto make_taps(Scalar const& s) -> std::vector<Tap>
+		{
+			std::vector<Tap> out = { Tap { .offset = {}, .weight = 1 } };
+			for (int d = 0; d < N; ++d) {
+				int m = (d < s.α.size()) ? s.α[d] : 0;
+				if (m == 0) {
+					continue;
+				}
+
+				std::vector<double> w = central_difference(m, P);
+				double max = 0;
+				for (double x : w) {
+					max = std::max(max, (x < 0) ? -x : x);
+				}
+
+				int r = central_radius(m, P);
+				std::vector<Tap> next;
+				for (Tap const& tap : out) {
+					for (int j = 0; j < int(w.size()); ++j) {
+						// Round-off leaves tiny weights where there should be zeros.
+						if ((w[j] < 0 ? -w[j] : w[j]) < 1e-12 * max) {
+							continue;
+						}
+						Tap t = tap;
+						t.offset[d] += j - r;
+						t.weight *= w[j];
+						next.push_back(t);
+					}
+				}
+				out = std::move(next);
+			}
+			return out;
+		}
+
+		constexpr static int n_primals = make_primals().size();
+
+		/// The primal scalars, which the field accessor provides.
+		constexpr static std::array primals = [] {
+			set<Scalar> primals = make_primals();
+			std::array<Scalar, n_primals> out;
+			std::copy(primals.begin(), primals.end(), out.begin());
+			return out;
+		}();
+
+		/// The primal id for each scalar id.
+		constexpr static std::array primal_ids = [] {
+			set<Scalar> primals = make_primals();
+			std::array<int, n_scalars> out;
+			for (int id = 0; id < n_scalars; ++id) {
+				out[id] = *primals.find(primal(scalars[id]));
+			}
+			return out;
+		}();
+
+		/// The scalar id of each primal, or -1 if the primal itself isn't one of
+		/// the scalars.
+		constexpr static std::array scalar_ids = [] {
+			std::array<int, n_primals> out;
+			for (int p = 0; p < n_primals; ++p) {
+				auto i = std::find(scalars.begin(), scalars.end(), primals[p]);
+				out[p] = (i != scalars.end()) ? int(i - scalars.begin()) : -1;
+			}
+			return out;
+		}();
+
+		/// The first tap of each scalar id, the taps for `id` are
+		/// [tap_offsets[id], tap_offsets[id + 1]).
+		constexpr static std::array tap_offsets = [] {
+			std::array<int, n_scalars + 1> out;
+			out[0] = 0;
+			for (int id = 0; id < n_scalars; ++id) {
+				out[id + 1] = out[id] + make_taps(scalars[id]).size();
+			}
+			return out;
+		}();
+
+		constexpr static int n_taps = tap_offsets[n_scalars];
+
+		constexpr static std::array taps = [] {
+			std::array<Tap, n_taps> out;
+			for (int id = 0; id < n_scalars; ++id) {
+				std::ranges::copy(make_taps(scalars[id]), out.begin() + tap_offsets[id]);
+			}
+			return out;
+		}();
+
+		/// The number of points that the stencils reach in any direction.
+		constexpr static int halo = [] {
+			int out = 0;
+			for (Tap const& tap : taps) {
+				for (int o : tap.offset) {
+					out = std::max(out, (o < 0) ? -o : o);
+				}
+			}
+			return out;
+		}();
+
+		std::array<int, N> extents;
+		std::array<int, N> strides;
+		std::array<int, n_taps> offsets; //!< the linear offset of each tap
+		std::array<double, n_taps> weights; //!< the weight of each tap, scaled by the spacing
+
+		/// Create the stencils for a grid with the `extents` (including the
+		/// halo) and the spacing `h` in each direction.
+		constexpr Stencil(std::array<int, N> const& extents, std::array<double, N> const& h)
+			: extents(extents)
+		{
+			int stride = 1;
+			for (int d = 0; d < N; ++d) {
+				strides[d] = stride;
+				stride *= extents[d];
+			}
+
+			for (int id = 0; id < n_scalars; ++id) {
+				Scalar const& s = scalars[id];
+				double scale = 1;
+				for (int d = 0; d < N && d < s.α.size(); ++d) {
+					for (int k = 0; k < s.α[d]; ++k) {
+						scale /= h[d];
+					}
+				}
+
+				for (int t = tap_offsets[id]; t < tap_offsets[id + 1]; ++t) {
+					offsets[t] = 0;
+					for (int d = 0; d < N; ++d) {
+						offsets[t] += taps[t].offset[d] * strides[d];
+					}
+					weights[t] = taps[t].weight * scale;
+				}
+			}
+		}
+
+		/// The point number for the grid coordinates `x`.
+		constexpr auto index(std::array<int, N> const& x) const -> int
+		{
+			int i = 0;
+			for (int d = 0; d < N; ++d) {
+				assert(0 <= x[d] && x[d] < extents[d]);
+				i += x[d] * strides[d];
+			}
+			return i;
+		}
+
+		/// Check to see if the point `i` is at least `halo` points away from the
+		/// boundary of the grid, i.e., if all of the stencils can be applied.
+		constexpr bool is_interior(int i) const
+		{
+			for (int d = N - 1; d >= 0; --d) {
+				int x = i / strides[d];
+				i -= x * strides[d];
+				if (x < halo || extents[d] - halo <= x) {
+					return false;
+				}
+			}
+			return true;
+		}
+
+		/// Create a scalar accessor for evaluate() from the primal field
+		/// accessor `fields(p, i)`, where `p` is a primal id.
+		///
+		/// The accessor refers to the stencil, and holds a copy of `fields`. It
+		/// must only be read for interior points (see is_interior()), which is
+		/// asserted in debug builds.
+		constexpr auto operator()(auto fields) const
+		{
+			return [this, fields](int id, int i) {
+				assert(is_interior(i));
+				using V = std::remove_cvref_t<decltype(fields(0, i))>;
+				int p = primal_ids[id];
+				V sum = V();
+				for (int t = tap_offsets[id]; t < tap_offsets[id + 1]; ++t) {
+					sum += weights[t] * fields(p, i + offsets[t]);
+				}
+				return sum;
+			};
+		}
+	};
+}
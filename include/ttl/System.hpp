@@ -2,7 +2,10 @@
 
 #include "TensorTree.hpp"
 #include "concepts.hpp"
+#include <algorithm>
+#include <array>
 #include <kumi/tuple.hpp>
+#include <utility>
 
 namespace ttl
 {
@@ -11,9 +14,13 @@ namespace ttl
 		using is_system_tag = void;
 
 		/// Create a system of equations from a pack of equations.
+		///
+		/// The pack may also contain definitions (see ttl::let()), which name
+		/// intermediate tensors that the equations can refer to.
 		constexpr System(is_equation auto... eqns)
 			: equations { std::move(eqns)... }
 		{
+			assert(definitions_are_ordered());
 		}
 
 		/// The tuple of equations.
@@ -38,11 +45,77 @@ namespace ttl
 			});
 		}
 
+		/// Call `op(lhs, root)` for each of the definitions in the system, in
+		/// order, where `root` is the root node of the definition's parse tree.
+		constexpr void definitions(auto&& op) const
+		{
+			equations([&](is_equation auto const&... eqns) {
+				([&] {
+					if constexpr (is_definition<decltype(eqns)>) {
+						op(eqns.lhs, eqns.rhs.root());
+					}
+				}(), ...);
+			});
+		}
+
+		/// Check that each definition only refers to the definitions before it.
+		///
+		/// The definitions are expanded in order, so a reference to a later
+		/// definition (or to itself) would be treated as an input instead.
+		constexpr bool definitions_are_ordered() const
+		{
+			bool ordered = true;
+			int k = 0;
+			equations([&](is_equation auto const&... eqns) {
+				([&] {
+					if constexpr (is_definition<decltype(eqns)>) {
+						int j = 0;
+						definitions([&](Tensor const& t, auto) {
+							if (k <= j++) {
+								ordered = ordered && std::none_of(eqns.rhs.begin(), eqns.rhs.end(), [&](ParseNode const& node) {
+									return node.tag == TENSOR && node.tensor == t;
+								});
+							}
+						});
+						++k;
+					}
+				}(), ...);
+			});
+			return ordered;
+		}
+
+		/// The positions of the update equations in `equations`, skipping the
+		/// definitions.
+		constexpr static auto update_ids()
+		{
+			return []<std::size_t... i>(std::index_sequence<i...>) {
+				constexpr bool update[] = { not is_definition<decltype(kumi::get<i>(std::declval<Equations&>()))>... };
+				std::array<std::size_t, std::ranges::count(update, true)> out;
+				std::size_t n = 0;
+				for (std::size_t k = 0; k < sizeof...(i); ++k) {
+					if (update[k]) {
+						out[n++] = k;
+					}
+				}
+				return out;
+			}(std::make_index_sequence<Equations::size()>());
+		}
+
+		/// Check to see if the passed tensor is defined by a definition.
+		constexpr bool is_defined(Tensor const& t) const
+		{
+			bool out = false;
+			definitions([&](Tensor const& u, auto) {
+				out = out || (t == u);
+			});
+			return out;
+		}
+
 		/// Check to see if the passed tensor is a constant.
 		///
 		/// Currently limited to just checking to see if the tensor appears on the
-		/// left-hand-side of a pde update equation. In the future we would like
-		/// this to be more sophisticated.
+		/// left-hand-side of a pde update equation or a definition. In the future
+		/// we would like this to be more sophisticated.
 		constexpr bool is_constant(Tensor const& t) const
 		{
 			return lhs([&](auto const&... u) {
@@ -58,36 +131,20 @@ namespace ttl
 		constexpr auto simplify(Tensor const& lhs, is_tree auto const& tree) const
 			-> TensorTree
 		{
-			return TensorTree(lhs, tree, [&](const Tensor& t) {
-				return is_constant(t);
-			});
-		}
-
-		/// Create a tuple of simplified trees corresponding to the system.
-		constexpr auto simplify_trees() const -> kumi::product_type auto
-		{
-			return equations([&](is_equation auto const&... eqns) {
-				return kumi::make_tuple(simplify(eqns.lhs, eqns.rhs)...);
-			});
+			return TensorTree(lhs, tree, *this);
 		}
 
-		/// Returns a tuple of shapes for the simplified trees.
+		/// Create a tuple of simplified trees corresponding to the update
+		/// equations in the system.
 		///
-		/// This shape depends on the dimensionality, as it requires knowledge about
-		/// how many scalars are going to be associated with tensors an immediate
-		/// values.
-		constexpr auto shapes(int N) const -> kumi::product_type auto
-		{
-			auto trees = simplify_trees();
-			return trees([N](is_tree auto const&... trees) {
-				return kumi::make_tuple(trees.shape(N)...);
-			});
-		}
-
-		/// Create a tuple of pairs of shapes and simplified trees.
-		constexpr auto simplify_trees(int N) const
+		/// The definitions are not included, they are expanded into the trees
+		/// that refer to them.
+		constexpr auto simplify_trees() const -> kumi::product_type auto
 		{
-			return kumi::zip(shapes(N), simplify_trees());
+			return [&]<std::size_t... n>(std::index_sequence<n...>) {
+				constexpr auto ids = update_ids();
+				return kumi::make_tuple(simplify(kumi::get<ids[n]>(equations).lhs, kumi::get<ids[n]>(equations).rhs)...);
+			}(std::make_index_sequence<update_ids().size()>());
 		}
 	};
 
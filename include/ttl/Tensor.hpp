@@ -3,6 +3,8 @@
 #include "ttl/Index.hpp"
 #include "ttl/Rational.hpp"
 #include "ttl/concepts.hpp"
+#include <array>
+#include <cassert>
 #include <format>
 #include <string_view>
 
@@ -87,6 +89,44 @@ namespace ttl
 	{
 		return { id, 2 };
 	}
+
+	/// Storage for the ids of compiler-generated tensors.
+	///
+	/// Tensor ids are string_views, so the ids for tensors that we introduce
+	/// while optimizing a system need to live in static storage like the ids
+	/// the user writes in their source code.
+	inline constexpr auto temporary_ids = [] {
+		std::array<std::array<char, 8>, TTL_MAX_TEMPORARIES> ids {};
+		for (int k = 0; k < TTL_MAX_TEMPORARIES; ++k) {
+			auto& id = ids[k];
+			int n = 0;
+			id[n++] = '%';
+			char digits[8];
+			int m = 0;
+			for (int d = k; m == 0 || d; d /= 10) {
+				digits[m++] = '0' + d % 10;
+			}
+			while (m) {
+				id[n++] = digits[--m];
+			}
+			id[7] = n; // stash the length in the last byte
+		}
+		return ids;
+	}();
+
+	/// Create the `k`th compiler-generated temporary tensor.
+	constexpr auto temporary(int k, int order) -> ttl::Tensor
+	{
+		assert(0 <= k and k < TTL_MAX_TEMPORARIES);
+		auto const& id = temporary_ids[k];
+		return { std::string_view(id.data(), id[7]), order };
+	}
+
+	/// Check to see if a tensor is a compiler-generated temporary.
+	constexpr bool is_temporary(Tensor const& t)
+	{
+		return t.id().starts_with('%');
+	}
 }
 
 template <>
@@ -4,12 +4,18 @@
 #include "ParseTree.hpp"
 #include "Rational.hpp"
 #include "Scalar.hpp"
+#include "StackAllocator.hpp"
 #include "TreeShape.hpp"
 #include "pow.hpp"
 #include "set.hpp"
+#include <algorithm>
+#include <bit>
+#include <compare>
+#include <cstdint>
 #include <format>
 #include <memory>
-#include <print>
+#include <tuple>
+#include <utility>
 #include <vector>
 
 namespace ttl
@@ -29,18 +35,27 @@ namespace ttl
 			};
 			bool constant = true;
 			int size = 1;
+			int refs = 1; //!< the number of owners, nodes can be shared
+			int id = -1;  //!< the id of the node in the Builder_ that interned it
+
+			mutable int need_dim = 0; //!< the dimension that `need` was computed for
+			mutable int need = 0;     //!< the cached stack_need(need_dim)
+
+			mutable int pattern_dim = 0;          //!< the dimension that `pattern` was computed for
+			mutable std::vector<bool> pattern {}; //!< the cached nonzeros(pattern_dim)
 
 			constexpr ~Node()
 			{
-				delete a_;
-				delete b_;
+				release(a_);
+				release(b_);
 			}
 
+			/// Copy a node, the copy shares the children of `rhs`.
 			constexpr Node(Node const& rhs)
 				: tag(rhs.tag)
 				, index(rhs.index)
-				, a_(clone(rhs.a_))
-				, b_(clone(rhs.b_))
+				, a_((rhs.a_) ? share(rhs.a_) : nullptr)
+				, b_((rhs.b_) ? share(rhs.b_) : nullptr)
 				, constant(rhs.constant)
 				, size(rhs.size)
 			{
@@ -112,11 +127,28 @@ namespace ttl
 				assert(tag_is_binary(tag));
 			}
 
+			/// Copy a node with the copy constructor, so the clone is shallow and
+			/// shares its children with `rhs`.
 			constexpr friend auto clone(const Node* rhs) -> Node*
 			{
 				return (rhs) ? new Node(*rhs) : nullptr;
 			}
 
+			/// Add an owner to a node.
+			constexpr friend auto share(Node* node) -> Node*
+			{
+				++node->refs;
+				return node;
+			}
+
+			/// Remove an owner from a node, deleting it when it has no owners left.
+			constexpr friend void release(Node* node)
+			{
+				if (node && --node->refs == 0) {
+					delete node;
+				}
+			}
+
 			constexpr auto a() const -> Node const*
 			{
 				return a_;
@@ -141,7 +173,7 @@ namespace ttl
 			constexpr auto all() const -> Index
 			{
 				if (tag == TENSOR) {
-					return unique(index) + repeated(index);
+					return exclusive(index) + repeated(index);
 				}
 				if (tag == PRODUCT || tag == RATIO) {
 					return index + (a_->outer() & b_->outer());
@@ -165,16 +197,48 @@ namespace ttl
 				return tag == RATIONAL && q == Rational(1);
 			}
 
+			/// Check to see if the index label `c` appears anywhere in the subtree.
+			constexpr bool uses(char c) const
+			{
+				if (tag_is_binary(tag)) {
+					return a_->uses(c) || b_->uses(c);
+				}
+				return index.count(c) != 0;
+			}
+
+			/// Check to see if the index label `c` is contracted anywhere in the
+			/// subtree.
+			constexpr bool contracts(char c) const
+			{
+				if (tag_is_binary(tag)) {
+					return (all() - index).count(c) || a_->contracts(c) || b_->contracts(c);
+				}
+				return tag == TENSOR && repeated(index).count(c);
+			}
+
+			/// Check to see if there is a Kronecker delta δ(a, b) in the subtree.
+			constexpr bool has_delta(char a, char b) const
+			{
+				if (tag_is_binary(tag)) {
+					return a_->has_delta(a, b) || b_->has_delta(a, b);
+				}
+				return tag == INDEX && index.count(a) && index.count(b);
+			}
+
 			constexpr friend bool is_equivalent(Node const* a, Node const* b)
 			{
 				assert(a && b);
+				if (a == b)
+					return true;
 				if (a->tag != b->tag)
 					return false;
 				if (a->index != b->index)
 					return false;
 				if (a->constant != b->constant)
 					return false;
-				switch (a->tag) { // todo: commutative
+				// The Builder_ sorts commutative operands, so commutative forms of the
+				// same expression are structurally identical.
+				switch (a->tag) {
 				case SUM:
 				case DIFFERENCE:
 				case PRODUCT:
@@ -211,64 +275,258 @@ namespace ttl
 				return ttl::pow(dim, order());
 			}
 
-			/// Collect the shape of the tree.
+			/// The structural zero pattern of the runtime tensor for this node.
 			///
-			/// The shape is a set of aggregate statistics about the tree, including
-			/// information like the number of nodes, the tree depth, the indices,
-			/// etc.
-			constexpr auto shape(int dim, std::vector<int>& stack) const -> TreeShape
+			/// Entry `c` is false when the element at the row-major offset `c` is
+			/// zero whatever the values of the scalars are, e.g., the off-diagonal
+			/// elements of `δ(i,j) * p`. The pattern is propagated from the deltas
+			/// through the sums and products, so a product only has the elements
+			/// that some nonzero pair of its operands contributes to.
+			///
+			/// The pattern is cached on the node like stack_need().
+			constexpr auto nonzeros(int dim) const -> std::vector<bool> const&
+			{
+				if (pattern_dim == dim) {
+					return pattern;
+				}
+
+				Index c = outer();
+				pattern.assign(tensor_size(dim), false);
+				switch (tag) {
+				case SUM:
+				case DIFFERENCE: {
+					auto const& a = a_->nonzeros(dim);
+					auto const& b = b_->nonzeros(dim);
+					Index bi = b_->outer();
+					ScalarIndex i(c.size());
+					do {
+						int ic = i.row_major(dim);
+						pattern[ic] = a[ic] || b[i.select(c, bi).row_major(dim)];
+					} while (i.carry_sum_inc(dim));
+				} break;
+
+				case PRODUCT: {
+					auto const& a = a_->nonzeros(dim);
+					auto const& b = b_->nonzeros(dim);
+					Index space = all();
+					Index ai = a_->outer();
+					Index bi = b_->outer();
+					ScalarIndex i(space.size());
+					do {
+						if (a[i.select(space, ai).row_major(dim)] && b[i.select(space, bi).row_major(dim)]) {
+							pattern[i.select(space, c).row_major(dim)] = true;
+						}
+					} while (i.carry_sum_inc(dim));
+				} break;
+
+				case RATIO:
+					pattern = a_->nonzeros(dim);
+					break;
+
+				case INDEX: {
+					ScalarIndex i(c.size());
+					do {
+						pattern[i.row_major(dim)] = (i[0] == i[1]);
+					} while (i.carry_sum_inc(dim));
+				} break;
+
+				default:
+					// The leaves are dense, immediate zeros are folded away when the
+					// tree is built.
+					pattern.assign(tensor_size(dim), true);
+				}
+
+				pattern_dim = dim;
+				return pattern;
+			}
+
+			/// How many elements of the runtime tensor for this node are stored,
+			/// i.e., the number of structural nonzeros.
+			constexpr auto footprint(int dim) const -> int
+			{
+				auto const& p = nonzeros(dim);
+				return std::count(p.begin(), p.end(), true);
+			}
+
+			/// Check to see if a binary node can write its result over its left
+			/// child.
+			///
+			/// This is true when the result has the same index as `a` and every
+			/// element of the result only depends on the same element of `a`. The
+			/// result must also have the same nonzeros as `a`, so that the two are
+			/// stored the same way. A sum has at least the nonzeros of `a`, so the
+			/// patterns match when the footprints do.
+			constexpr bool in_place(int dim) const
+			{
+				switch (tag) {
+				case SUM:
+				case DIFFERENCE:
+					return footprint(dim) == a_->footprint(dim);
+				case RATIO:
+					return true;
+				default:
+					return false;
+				}
+			}
+
+			/// The number of stack slots needed to evaluate this subtree.
+			///
+			/// This is the Sethi-Ullman number for the tree, weighted by the sizes
+			/// of the intermediate tensors, assuming that each binary node evaluates
+			/// its more expensive child first.
+			///
+			/// The number is cached on the node, so computing it for a whole tree
+			/// visits each node once, bottom-up, and later queries (e.g., from
+			/// b_first()) are constant time. Passes that rewrite a subtree in place
+			/// must call invalidate() on the nodes above it.
+			constexpr auto stack_need(int dim) const -> int
 			{
-				int top_of_stack = stack.back();
-				stack.push_back(top_of_stack + tensor_size(dim));
+				if (!tag_is_binary(tag)) {
+					return footprint(dim);
+				}
 
-				if (!std::is_constant_evaluated()) {
-					std::print("tree shape stack:{} ({} + {})\n", stack.back(), top_of_stack, tensor_size(dim));
+				if (need_dim != dim) {
+					int na = a_->stack_need(dim);
+					int nb = b_->stack_need(dim);
+					need = std::min(stack_need(dim, na, nb, false), stack_need(dim, na, nb, true));
+					need_dim = dim;
 				}
+				return need;
+			}
 
+			/// Clear the cached stack_need() and nonzeros().
+			constexpr void invalidate()
+			{
+				need_dim = 0;
+				pattern_dim = 0;
+			}
+
+			constexpr auto stack_need(int dim, int na, int nb, bool b_first) const -> int
+			{
+				int sa = a_->footprint(dim);
+				int sb = b_->footprint(dim);
+				int n = (b_first) ? std::max(nb, sb + na) : std::max(na, sa + nb);
+				return (in_place(dim)) ? n : std::max(n, sa + sb + footprint(dim));
+			}
+
+			/// Check to see if the right child should be evaluated before the left.
+			constexpr bool b_first(int dim) const
+			{
+				assert(tag_is_binary(tag));
+				int na = a_->stack_need(dim);
+				int nb = b_->stack_need(dim);
+				return stack_need(dim, na, nb, true) < stack_need(dim, na, nb, false);
+			}
+
+			/// Visit the nodes of the tree in the order that SerializedTree stores
+			/// them, i.e., the node `k` passed to `op` is the serialized node `k`.
+			constexpr void for_each_serialized(int dim, auto&& op) const
+			{
+				if (tag_is_binary(tag)) {
+					if (b_first(dim)) {
+						b_->for_each_serialized(dim, op);
+						a_->for_each_serialized(dim, op);
+					} else {
+						a_->for_each_serialized(dim, op);
+						b_->for_each_serialized(dim, op);
+					}
+				}
+				op(this);
+			}
+
+			/// Allocate the stack slot for this node's result.
+			///
+			/// The slot only holds the structural nonzeros (see footprint()). The
+			/// children of a binary node must already have been allocated.
+			/// In-place nodes take over their left child's slot, otherwise the
+			/// result is allocated before the children are released so that the
+			/// kernel never overwrites its own operands.
+			constexpr auto allocate(int dim, StackAllocator& stack, int ra = -1, int rb = -1) const -> int
+			{
+				if (!tag_is_binary(tag)) {
+					return stack.allocate(footprint(dim));
+				}
+
+				if (in_place(dim)) {
+					stack.release(rb);
+					return ra;
+				}
+
+				int rk = stack.allocate(footprint(dim));
+				stack.release(ra);
+				stack.release(rb);
+				return rk;
+			}
+
+			/// Collect the shape of the tree.
+			///
+			/// The shape is a set of aggregate statistics about the tree, including
+			/// information like the number of nodes, the tree depth, the indices,
+			/// etc. The slot that holds this node's result is returned in `rk`.
+			constexpr auto shape(int dim, StackAllocator& stack, int& rk) const -> TreeShape
+			{
 				switch (tag) {
 				case SUM:
 				case DIFFERENCE:
 				case PRODUCT:
 				case RATIO: {
-					TreeShape a = a_->shape(dim, stack);
-					TreeShape b = b_->shape(dim, stack);
-					stack.pop_back();
-					stack.pop_back();
+					int ra, rb;
+					auto [a, b] = [&] {
+						if (b_first(dim)) {
+							TreeShape b = b_->shape(dim, stack, rb);
+							TreeShape a = a_->shape(dim, stack, ra);
+							return std::pair(a, b);
+						}
+						TreeShape a = a_->shape(dim, stack, ra);
+						TreeShape b = b_->shape(dim, stack, rb);
+						return std::pair(a, b);
+					}();
+
+					rk = allocate(dim, stack, ra, rb);
 
 					// Merge the children tree shape data and append the indiex counts
 					// from this node.
 					return TreeShape(a, b,
-						{ .n_inner_indices = all().size(), .n_indices = order() });
+						{ .n_inner_indices = all().size(),
+							.n_indices = order(),
+							.n_pattern = tensor_size(dim),
+							.stack_depth = stack.depth });
 				}
 
 				case INDEX: {
 					assert(index.size() == 2);
 					assert(order() == 2);
+					rk = allocate(dim, stack);
 					return TreeShape({ .dims = dim,
 						.n_indices = 2,
-						.stack_depth = stack.back() });
+						.n_pattern = tensor_size(dim),
+						.stack_depth = stack.depth });
 				}
 
 				case DOUBLE:
 				case RATIONAL: {
 					assert(index.size() == 0);
 					assert(order() == 0);
+					rk = allocate(dim, stack);
 					return TreeShape({ .n_immediates = 1,
 						.dims = dim,
 						.n_indices = 0,
-						.stack_depth = stack.back() });
+						.n_pattern = 1,
+						.stack_depth = stack.depth });
 				}
 
 				case TENSOR: {
 					int m = all().size();
 					int n = ttl::pow(dim, m);
+					rk = allocate(dim, stack);
 					return TreeShape({ .n_scalars = n,
 						.n_inner_indices = m,
 						.n_tensor_indices = index.size(),
 						.n_tensor_ids = (int)tensor.id().size(),
 						.dims = dim,
 						.n_indices = order(),
-						.stack_depth = stack.back() });
+						.n_pattern = tensor_size(dim),
+						.stack_depth = stack.depth });
 				}
 
 				default:
@@ -319,29 +577,65 @@ namespace ttl
 		};
 
 		Tensor lhs_;
+		Index index_; //!< the index of the lhs, in the order the user wrote it
 		Node* root_;
 
 		constexpr ~TensorTree()
 		{
-			delete root_;
+			release(root_);
 		}
 
 		template <int M>
 		constexpr TensorTree(Tensor const& lhs, ParseTree<M> const& tree, auto const& constants)
+			: TensorTree(lhs, tree, constants, [](auto&&) {})
+		{
+		}
+
+		/// Create a tree with access to a set of definitions.
+		///
+		/// The `definitions` are enumerated by calling `definitions(op)`, which
+		/// calls `op(lhs, root)` for each of them in order. References to the
+		/// derivatives of a defined tensor are expanded using its definition.
+		template <int M>
+		constexpr TensorTree(Tensor const& lhs, ParseTree<M> const& tree, auto const& constants, auto const& definitions)
 			: lhs_(lhs)
-			, root_(map(tree.root(), constants))
+			, index_(tree.outer())
+			, root_([&] {
+				Builder_ builder;
+				definitions([&](Tensor const& t, ParseNode const* root) {
+					builder.define(t, root, constants);
+				});
+				return builder.map(tree.root(), constants);
+			}())
 		{
+			assert(permutation(index_, root_->outer()));
 		}
 
 		template <int M>
 		constexpr TensorTree(Tensor const& lhs, ParseTree<M> const& tree, is_system auto const& system)
-			: TensorTree(lhs, tree, [&](Tensor const& t) { return system.is_constant(t); })
+			: TensorTree(
+				lhs,
+				tree,
+				[&](Tensor const& t) { return system.is_constant(t); },
+				[&](auto&& op) { system.definitions(op); })
 		{
 		}
 
+		/// Create a tree that computes `lhs` from an existing node.
+		///
+		/// The tree takes ownership of the `root`.
+		constexpr TensorTree(Tensor const& lhs, Node* root)
+			: lhs_(lhs)
+			, index_(root->outer())
+			, root_(root)
+		{
+			assert(lhs_.order() == root_->order());
+		}
+
 		constexpr TensorTree(TensorTree const&) = delete;
 		constexpr TensorTree(TensorTree&& b)
 			: lhs_(b.lhs_)
+			, index_(b.index_)
 			, root_(std::exchange(b.root_, nullptr))
 		{
 			assert(lhs_.order() == root_->order());
@@ -362,6 +656,16 @@ namespace ttl
 			return root_->outer();
 		}
 
+		/// The index of the left-hand-side.
+		///
+		/// Simplification can reorder the outer index of the root (it is always a
+		/// permutation of this index), so this is the index that defines which
+		/// component of the lhs each component of the root corresponds to.
+		constexpr auto lhs_index() const -> Index const&
+		{
+			return index_;
+		}
+
 		constexpr auto order() const -> int
 		{
 			return outer().size();
@@ -376,29 +680,32 @@ namespace ttl
 
 		constexpr auto scalars(int N, set<Scalar>& out) const -> decltype(auto)
 		{
+			// The same scalars show up in many nodes, so collect them all and then
+			// insert them as a batch.
+			std::vector<Scalar> scalars;
 			for (Node const* node : tensors()) {
 				assert(node->tag == TENSOR);
 				node->scalars(N, [&](Scalar scalar) {
-					out.emplace(std::move(scalar));
+					scalars.push_back(std::move(scalar));
 				});
 			}
 
 			ScalarIndex index(order());
 			do {
-				out.emplace(lhs_, index, false);
+				scalars.emplace_back(lhs_, index, false, N);
 			} while (index.carry_sum_inc(N));
 
+			out.insert(scalars.begin(), scalars.end());
 			return out;
 		}
 
 		constexpr auto shape(int dim) const -> TreeShape
 		{
-			// allocate space on the stack for the returned tensor
-			std::vector<int> stack;
-			stack.push_back(0);
-			TreeShape out = root_->shape(dim, stack);
-			assert(stack.size() == 2);
-			assert(stack.back() == root_->tensor_size(dim));
+			StackAllocator stack;
+			int rk;
+			TreeShape out = root_->shape(dim, stack, rk);
+			assert(stack.live.size() == 1);
+			assert(stack.depth == out.stack_depth);
 			return out;
 		}
 
@@ -408,177 +715,800 @@ namespace ttl
 		}
 
 	private:
-		constexpr static auto map(const ParseNode* node, auto const& constants) -> Node*
-		{
-			switch (node->tag) {
-			default:
-				return reduce(node->tag, map(node->a(), constants), map(node->b(), constants));
-			case PARTIAL:
-				return dx(map(node->a(), constants), node->b()->index);
-			case INDEX:
-				return new Node(node->index);
-			case TENSOR:
-				return new Node(node->tensor, node->index, constants(node->tensor));
-			case RATIONAL:
-				return new Node(node->q);
-			case DOUBLE:
-				return new Node(node->d);
+		/// Builds the nodes of a tree.
+		///
+		/// Every node that is created while building a tree goes through
+		/// intern(), which returns the existing node if there is an identical
+		/// one. Children are compared by address, so identical subexpressions
+		/// share a single node and the tree is really a DAG. The derivatives of
+		/// each node are memoized, so differentiating a shared subexpression
+		/// (e.g., the denominator in the quotient rule) is only done once.
+		///
+		/// The reductions produce a canonical form. Sums and outer products are
+		/// flattened, their operands are sorted, rational coefficients are folded,
+		/// and like terms in sums are collected. Together with interning, this
+		/// makes `a*b + b*a` into `2*(a*b)`.
+		///
+		/// Interned nodes are never modified while the builder exists, the
+		/// rewrites create new nodes instead. The builder owns a reference to
+		/// every node it interns, so ids and addresses stay valid until it is
+		/// destroyed. After that the tree is just a DAG of shared nodes, and the
+		/// later passes over the system (CommonSubexpressions and
+		/// ConstantSubexpressions) do rewrite shared subtrees in place, which
+		/// updates every parent that shares them.
+		struct Builder_ {
+			struct Entry {
+				std::uint64_t hash;
+				Node* node;
+				std::vector<std::pair<Index, Node*>> derivatives;
+			};
+
+			/// A defined tensor, whose derivatives are expanded with the chain rule.
+			struct Definition {
+				Tensor lhs;
+				Index index; //!< the outer index, in the order of the lhs components
+				Node* root;
+			};
+
+			std::vector<Entry> entries;                                       //!< the interned nodes, by id
+			std::vector<std::vector<int>> buckets = std::vector<std::vector<int>>(64); //!< the node ids, by hash
+			std::vector<Definition> definitions;                              //!< the definitions, in order
+
+			constexpr Builder_() = default;
+			constexpr Builder_(Builder_ const&) = delete;
+
+			constexpr ~Builder_()
+			{
+				for (Definition& d : definitions) {
+					release(d.root);
+				}
+				for (Entry& entry : entries) {
+					for (auto& [index, node] : entry.derivatives) {
+						release(node);
+					}
+					release(entry.node);
+				}
 			}
-		}
 
-		constexpr static auto reduce(Tag tag, Node* a, Node* b) -> Node*
-		{
-			switch (tag) {
-			case SUM:
-				return reduce_sum(a, b);
-			case DIFFERENCE:
-				return reduce_difference(a, b);
-			case PRODUCT:
-				return reduce_product(a, b);
-			case RATIO:
-				return reduce_ratio(a, b);
-			default:
-				assert(false);
-			}
-			__builtin_unreachable();
-		}
+			constexpr static auto mix(std::uint64_t h, std::uint64_t x) -> std::uint64_t
+			{
+				return (h ^ x) * 0x100000001b3;
+			}
 
-		constexpr static auto reduce_sum(Node* a, Node* b) -> Node*
-		{
-			if (a->is_zero()) {
-				delete a;
-				return b;
+			/// Hash a node whose children are already interned.
+			constexpr static auto hash(Node const* node) -> std::uint64_t
+			{
+				std::uint64_t h = mix(0xcbf29ce484222325, node->tag);
+				for (char c : node->index) {
+					h = mix(h, c);
+				}
+				h = mix(h, node->constant);
+
+				switch (node->tag) {
+				case SUM:
+				case DIFFERENCE:
+				case PRODUCT:
+				case RATIO:
+					return mix(mix(h, node->a_->id), node->b_->id);
+
+				case DOUBLE:
+					return mix(h, std::bit_cast<std::uint64_t>(node->d));
+
+				case RATIONAL:
+					return mix(mix(h, node->q.p), node->q.q);
+
+				case TENSOR:
+					for (char c : node->tensor.id()) {
+						h = mix(h, c);
+					}
+					return mix(h, node->tensor.order());
+
+				default:
+					return h;
+				}
 			}
-			if (b->is_zero()) {
-				delete b;
-				return a;
+
+			/// Check to see if two nodes are identical, given that their children
+			/// are interned.
+			constexpr static bool is_identical(Node const* a, Node const* b)
+			{
+				if (a->tag != b->tag || a->index != b->index || a->constant != b->constant) {
+					return false;
+				}
+
+				switch (a->tag) {
+				case SUM:
+				case DIFFERENCE:
+				case PRODUCT:
+				case RATIO:
+					return a->a_ == b->a_ && a->b_ == b->b_;
+				case DOUBLE:
+					return a->d == b->d;
+				case RATIONAL:
+					return a->q == b->q;
+				case TENSOR:
+					return a->tensor == b->tensor;
+				default:
+					return true;
+				}
 			}
-			if (is_equivalent(a, b)) {
-				delete a;
-				return new Node(PRODUCT, new Node(2), b);
+
+			/// Return the interned node that is identical to `node`.
+			///
+			/// This takes ownership of `node`, which is released if an identical
+			/// node already exists.
+			constexpr auto intern(Node* node) -> Node*
+			{
+				std::uint64_t h = hash(node);
+				std::vector<int>& bucket = buckets[h & (buckets.size() - 1)];
+				for (int id : bucket) {
+					if (entries[id].hash == h && is_identical(entries[id].node, node)) {
+						release(node);
+						return share(entries[id].node);
+					}
+				}
+
+				node->id = entries.size();
+				bucket.push_back(node->id);
+				entries.push_back({ h, share(node), {} });
+
+				if (entries.size() > 2 * buckets.size()) {
+					buckets = std::vector<std::vector<int>>(2 * buckets.size());
+					for (Entry const& entry : entries) {
+						buckets[entry.hash & (buckets.size() - 1)].push_back(entry.node->id);
+					}
+				}
+
+				return node;
 			}
-			return new Node(SUM, a, b);
-		}
 
-		constexpr static auto reduce_difference(Node* a, Node* b) -> Node*
-		{
-			if (b->is_zero()) {
-				delete b;
-				return a;
+			template <class... Ts>
+			constexpr auto make(Ts&&... ts) -> Node*
+			{
+				return intern(new Node(std::forward<Ts>(ts)...));
 			}
-			if (a->is_zero()) {
-				delete a;
-				return new Node(PRODUCT, new Node(-1), b);
+
+			/// Record the definition of `lhs` as the tree rooted at `root`.
+			///
+			/// Definitions may only refer to the definitions recorded before them.
+			constexpr void define(Tensor const& lhs, const ParseNode* root, auto const& constants)
+			{
+				definitions.push_back({ lhs, exclusive(root->index), map(root, constants) });
 			}
-			if (is_equivalent(a, b)) {
-				delete a;
-				delete b;
-				return new Node(0);
+
+			constexpr auto find_definition(Tensor const& t) const -> Definition const*
+			{
+				for (Definition const& d : definitions) {
+					if (d.lhs == t) {
+						return &d;
+					}
+				}
+				return nullptr;
 			}
-			return new Node(DIFFERENCE, a, b);
-		}
 
-		constexpr static auto reduce_product(Node* a, Node* b) -> Node*
-		{
-			if (a->is_zero()) {
-				delete b;
-				return a;
+			/// Instantiate a definition for a reference with the index `index`.
+			///
+			/// Labels that the definition contracts internally are first moved out
+			/// of the way of the new labels, and the outer labels are renamed
+			/// through placeholders so that the renames can't interfere with each
+			/// other (e.g., for `σ(b,a)`).
+			constexpr auto instantiate(Definition const& d, Index const& index) -> Node*
+			{
+				assert(d.index.size() == index.size());
+
+				Node* node = share(d.root);
+				auto fresh = [&] {
+					char c = 1;
+					while (node->uses(c) || index.count(c) || d.index.count(c)) {
+						++c;
+					}
+					return c;
+				};
+
+				for (char c : index) {
+					if (!d.index.count(c) && node->uses(c)) {
+						node = rename(node, c, fresh());
+					}
+				}
+
+				Index placeholders;
+				for (char c : d.index) {
+					placeholders.push_back(fresh());
+					node = rename(node, c, placeholders[placeholders.size() - 1]);
+				}
+
+				for (int i = 0; i < index.size(); ++i) {
+					node = rename(node, placeholders[i], index[i]);
+				}
+
+				return node;
 			}
-			if (b->is_zero()) {
-				delete a;
-				return b;
+
+			constexpr auto map(const ParseNode* node, auto const& constants) -> Node*
+			{
+				switch (node->tag) {
+				default:
+					return reduce(node->tag, map(node->a(), constants), map(node->b(), constants));
+				case PARTIAL:
+					return dx(map(node->a(), constants), node->b()->index);
+				case INDEX:
+					return make(node->index);
+				case TENSOR:
+					return make(node->tensor, node->index, constants(node->tensor));
+				case RATIONAL:
+					return make(node->q);
+				case DOUBLE:
+					return make(node->d);
+				}
 			}
-			if (a->is_one()) {
-				delete a;
-				return b;
+
+			constexpr auto reduce(Tag tag, Node* a, Node* b) -> Node*
+			{
+				switch (tag) {
+				case SUM:
+					return reduce_sum(a, b);
+				case DIFFERENCE:
+					return reduce_difference(a, b);
+				case PRODUCT:
+					return reduce_product(a, b);
+				case RATIO:
+					return reduce_ratio(a, b);
+				default:
+					assert(false);
+				}
+				__builtin_unreachable();
 			}
-			if (b->is_one()) {
-				delete b;
-				return a;
+
+			constexpr auto reduce_sum(Node* a, Node* b) -> Node*
+			{
+				return sum(a, b, 1);
 			}
-			return new Node(PRODUCT, a, b);
-		}
 
-		constexpr static auto reduce_ratio(Node* a, Node* b) -> Node*
-		{
-			if (a->is_zero()) {
-				delete b;
-				return a;
+			constexpr auto reduce_difference(Node* a, Node* b) -> Node*
+			{
+				return sum(a, b, -1);
 			}
-			if (b->is_zero()) {
-				assert(false);
+
+			constexpr auto reduce_product(Node* a, Node* b) -> Node*
+			{
+				if (a->is_zero()) {
+					release(b);
+					return a;
+				}
+				if (b->is_zero()) {
+					release(a);
+					return b;
+				}
+				if (a->is_one()) {
+					release(a);
+					return b;
+				}
+				if (b->is_one()) {
+					release(b);
+					return a;
+				}
+				if (Node* node = eliminate_delta(a, b)) {
+					return node;
+				}
+				if (Node* node = eliminate_delta(b, a)) {
+					return node;
+				}
+				if (Node* delta = extract_delta(a, b)) {
+					return reduce_product(delta, reduce_product(a, b));
+				}
+				if (Node* delta = extract_delta(b, a)) {
+					return reduce_product(reduce_product(a, b), delta);
+				}
+				return product(a, b);
 			}
-			if (b->is_one()) {
-				delete b;
-				return a;
+
+			/// The factors of a product, with the rational factors folded into a
+			/// single coefficient.
+			struct Factors {
+				Rational q = 1;
+				std::vector<Node*> nodes;
+			};
+
+			/// A term in a sum, `q * node`, where a null `node` is the constant 1.
+			struct Term {
+				Rational q;
+				Node* node;
+			};
+
+			/// Compare two nodes by their structure: the tag, then the tensor, value,
+			/// or index labels, and then the children, recursively.
+			///
+			/// Distinct interned nodes always differ somewhere, so this is a total
+			/// order on them, and unlike the ids it doesn't depend on the order in
+			/// which the nodes were interned. Two builders put the same operands
+			/// in the same order.
+			constexpr static auto compare(Node const* a, Node const* b) -> std::strong_ordering
+			{
+				if (a == b) {
+					return std::strong_ordering::equal;
+				}
+				if (auto c = a->tag <=> b->tag; c != 0) {
+					return c;
+				}
+				if (auto c = a->constant <=> b->constant; c != 0) {
+					return c;
+				}
+
+				switch (a->tag) {
+				case TENSOR:
+					if (auto c = a->tensor <=> b->tensor; c != 0) {
+						return c;
+					}
+					break;
+				case RATIONAL:
+					if (auto c = std::tuple(a->q.p, a->q.q) <=> std::tuple(b->q.p, b->q.q); c != 0) {
+						return c;
+					}
+					break;
+				case DOUBLE:
+					if (auto c = std::strong_order(a->d, b->d); c != 0) {
+						return c;
+					}
+					break;
+				default:
+					break;
+				}
+
+				if (auto c = a->index <=> b->index; c != 0) {
+					return c;
+				}
+
+				if (tag_is_binary(a->tag)) {
+					if (auto c = compare(a->a(), b->a()); c != 0) {
+						return c;
+					}
+					return compare(a->b(), b->b());
+				}
+
+				return std::strong_ordering::equal;
 			}
-			if (is_equivalent(a, b)) {
-				// todo: not really safe
-				delete a;
-				delete b;
-				return new Node(1);
+
+			/// The canonical order of the operands of a commutative operation.
+			///
+			/// Scalars come before tensors so that they are multiplied together
+			/// before they scale anything, and constants come before non-constants
+			/// so that the constant factors form a subtree that can be hoisted. The
+			/// remaining ties are broken structurally (see compare()).
+			constexpr static bool precedes(Node const* a, Node const* b)
+			{
+				if (auto c = std::tuple(a->order(), !a->constant) <=> std::tuple(b->order(), !b->constant); c != 0) {
+					return c < 0;
+				}
+				return compare(a, b) < 0;
 			}
-			return new Node(RATIO, a, b);
-		}
 
-		constexpr static auto dx(Node* node, Index const& index) -> Node*
-		{
-			if (node->constant) {
-				delete node;
-				return new Node(0);
+			/// Flatten a tree of outer products into its factors, taking ownership
+			/// of `node`.
+			///
+			/// Products that contract indices are factors themselves, as the
+			/// contraction can't be reassociated with the other factors. Rational
+			/// factors are folded into the coefficient.
+			constexpr void factor(Node* node, Factors& out)
+			{
+				if (node->tag == RATIONAL) {
+					out.q *= node->q;
+					release(node);
+					return;
+				}
+
+				if (node->tag == PRODUCT && (node->a_->outer() & node->b_->outer()).size() == 0) {
+					Node* a = share(node->a_);
+					Node* b = share(node->b_);
+					release(node);
+					factor(a, out);
+					factor(b, out);
+					return;
+				}
+
+				out.nodes.push_back(node);
 			}
 
-			if (node->tag == TENSOR) {
-				node->index += index;
-				return node;
+			/// Build the canonical product of a coefficient and a set of factors
+			/// with disjoint outer indices.
+			///
+			/// The factors are sorted and multiplied left to right, after the
+			/// coefficient.
+			constexpr auto chain(Rational q, std::vector<Node*>& nodes) -> Node*
+			{
+				std::sort(nodes.begin(), nodes.end(), precedes);
+				Node* out = (q != Rational(1) || nodes.empty()) ? make(q) : nullptr;
+				for (Node* node : nodes) {
+					out = (out) ? make(PRODUCT, out, node) : node;
+				}
+				nodes.clear();
+				return out;
 			}
 
-			Tag tag = node->tag;
-			Node* a = std::exchange(node->a_, nullptr);
-			Node* b = std::exchange(node->b_, nullptr);
-			delete node;
-
-			switch (tag) {
-			case SUM:
-				return reduce(SUM, dx(a, index), dx(b, index));
-			case DIFFERENCE:
-				return reduce(DIFFERENCE, dx(a, index), dx(b, index));
-			case PRODUCT:
-				return dx_product(a, b, index);
-			case RATIO:
-				return dx_quotient(a, b, index);
-			default:
-				assert(false);
-			}
-			__builtin_unreachable();
-		}
+			/// Build the canonical product `a * b`.
+			///
+			/// The operands are flattened into a single coefficient and a sorted
+			/// list of factors. When `a` and `b` contract with each other only their
+			/// scalar factors can be moved, the remaining factors from each side
+			/// are multiplied separately and then contracted.
+			constexpr auto product(Node* a, Node* b) -> Node*
+			{
+				bool contracts = (a->outer() & b->outer()).size() != 0;
 
-		constexpr static auto dx_product(Node* a, Node* b, Index const& index) -> Node*
-		{
-			if (a->constant) {
-				return reduce(PRODUCT, a, dx(b, index));
+				Factors fa, fb;
+				factor(a, fa);
+				factor(b, fb);
+
+				Rational q = fa.q * fb.q;
+				if (q == Rational(0)) {
+					for (Node* node : fa.nodes) {
+						release(node);
+					}
+					for (Node* node : fb.nodes) {
+						release(node);
+					}
+					return make(0);
+				}
+
+				if (!contracts) {
+					fa.nodes.insert(fa.nodes.end(), fb.nodes.begin(), fb.nodes.end());
+					return chain(q, fa.nodes);
+				}
+
+				std::vector<Node*> scalars, ta, tb;
+				for (Node* node : fa.nodes) {
+					(node->order() == 0 ? scalars : ta).push_back(node);
+				}
+				for (Node* node : fb.nodes) {
+					(node->order() == 0 ? scalars : tb).push_back(node);
+				}
+
+				Node* x = chain(1, ta);
+				Node* y = chain(1, tb);
+				scalars.push_back((precedes(y, x)) ? make(PRODUCT, y, x) : make(PRODUCT, x, y));
+				return chain(q, scalars);
 			}
-			if (b->constant) {
-				return reduce(PRODUCT, dx(a, index), b);
+
+			/// Flatten a tree of sums and differences into its terms, taking
+			/// ownership of `node`.
+			///
+			/// The coefficient of each term is split from the rest of the term, so
+			/// that like terms have the same node.
+			constexpr void terms(Node* node, Rational q, std::vector<Term>& out)
+			{
+				if (node->tag == SUM || node->tag == DIFFERENCE) {
+					Node* a = share(node->a_);
+					Node* b = share(node->b_);
+					Rational qb = (node->tag == SUM) ? q : -q;
+					release(node);
+					terms(a, q, out);
+					terms(b, qb, out);
+					return;
+				}
+
+				Factors f;
+				factor(node, f);
+				out.push_back({ q * f.q, (f.nodes.empty()) ? nullptr : chain(1, f.nodes) });
 			}
 
-			// (a'b + ab')
-			Node* t = reduce(PRODUCT, dx(clone(a), index), clone(b));
-			Node* u = reduce(PRODUCT, a, dx(b, index));
-			return reduce(SUM, t, u);
-		}
+			/// Build the canonical product `q * node` for a term.
+			constexpr auto scale(Rational q, Node* node) -> Node*
+			{
+				if (!node) {
+					return make(q);
+				}
 
-		constexpr static auto dx_quotient(Node* a, Node* b, Index const& index) -> Node*
-		{
-			if (b->constant) {
-				return reduce(RATIO, dx(a, index), b);
+				Factors f;
+				factor(node, f);
+				return chain(q * f.q, f.nodes);
 			}
 
-			// (a'b - ab')/b^2
-			Node* b2 = reduce(PRODUCT, clone(b), clone(b));
-			Node* ap_b = reduce(PRODUCT, dx(clone(a), index), clone(b));
-			Node* a_bp = reduce(PRODUCT, a, dx(b, index));
-			return reduce(RATIO, reduce(DIFFERENCE, ap_b, a_bp), b2);
-		}
+			/// Build the canonical sum `a + sign * b`.
+			///
+			/// The operands are flattened into a list of terms, like terms are
+			/// collected by adding their coefficients, and the terms with nonzero
+			/// coefficients are sorted and summed left to right. Terms with negative
+			/// coefficients are subtracted.
+			constexpr auto sum(Node* a, Node* b, Rational sign) -> Node*
+			{
+				std::vector<Term> ts;
+				terms(a, 1, ts);
+				terms(b, sign, ts);
+
+				// The constant 1 comes first, then the constant terms, and the rest
+				// are ordered structurally (see compare()), so like terms are
+				// adjacent.
+				std::sort(ts.begin(), ts.end(), [](Term const& x, Term const& y) {
+					if (!x.node || !y.node) {
+						return !x.node && y.node;
+					}
+					if (x.node->constant != y.node->constant) {
+						return x.node->constant;
+					}
+					return compare(x.node, y.node) < 0;
+				});
+
+				std::vector<Term> collected;
+				for (Term const& t : ts) {
+					if (!collected.empty() && collected.back().node == t.node) {
+						collected.back().q = collected.back().q + t.q;
+						release(t.node);
+					} else {
+						collected.push_back(t);
+					}
+				}
+
+				Node* out = nullptr;
+				for (Term const& t : collected) {
+					if (t.q == Rational(0)) {
+						release(t.node);
+					} else if (!out) {
+						out = scale(t.q, t.node);
+					} else if (t.q.is_negative()) {
+						out = make(DIFFERENCE, out, scale(-t.q, t.node));
+					} else {
+						out = make(SUM, out, scale(t.q, t.node));
+					}
+				}
+
+				return (out) ? out : make(0);
+			}
+
+			/// Rename an index label throughout a subtree.
+			///
+			/// This takes ownership of `node` and returns the renamed subtree.
+			constexpr auto rename(Node* node, char from, char to) -> Node*
+			{
+				if (tag_is_binary(node->tag)) {
+					Node* a = rename(share(node->a_), from, to);
+					Node* b = rename(share(node->b_), from, to);
+					if (a == node->a_ && b == node->b_) {
+						release(a);
+						release(b);
+						return node;
+					}
+
+					Tag tag = node->tag;
+					release(node);
+					return make(tag, a, b);
+				}
+
+				Index index = node->index;
+				for (char& c : index) {
+					c = (c == from) ? to : c;
+				}
+
+				if (index == node->index) {
+					return node;
+				}
+
+				Node* out = new Node(*node);
+				out->index = index;
+				release(node);
+				return intern(out);
+			}
+
+			/// Find the label to rename in order to contract δ(p, q) with `x`.
+			///
+			/// There are three cases where the delta can be removed.
+			///
+			/// 1. `q` is an outer index of `x` and `p` doesn't occur in `x`: rename
+			///    `q` to `p`, i.e., δ(p, q)x(q) = x(p).
+			/// 2. The symmetric case with `p` and `q` swapped.
+			/// 3. Both `p` and `q` are outer indices of `x`: rename `q` to `p`, which
+			///    turns the contraction into a trace, i.e., δ(p, q)x(p, q) = x(p, p).
+			///    This is only done when neither label is already contracted in `x`
+			///    and `x` doesn't contain its own δ(p, q), which would become a trace
+			///    of the identity (i.e., the dimension).
+			///
+			/// @returns The {from, to} labels, or {0, 0} if the delta can't be
+			///          removed.
+			constexpr static auto delta_rename(Node const* delta, Node const* x) -> std::pair<char, char>
+			{
+				if (delta->tag != INDEX) {
+					return { 0, 0 };
+				}
+
+				char p = delta->index[0];
+				char q = delta->index[1];
+				if (p == q) {
+					return { 0, 0 };
+				}
+
+				Index outer = x->outer();
+				bool has_p = outer.count(p);
+				bool has_q = outer.count(q);
+
+				if (has_q && !x->uses(p)) {
+					return { q, p };
+				}
+
+				if (has_p && !x->uses(q)) {
+					return { p, q };
+				}
+
+				if (has_p && has_q && !x->contracts(p) && !x->contracts(q) && !x->has_delta(p, q)) {
+					return { q, p };
+				}
+
+				return { 0, 0 };
+			}
+
+			/// Remove a Kronecker delta from the product δ * x by renaming an index
+			/// in `x`.
+			///
+			/// @returns The rewritten `x` (taking ownership of both nodes), or nullptr
+			///          if the delta couldn't be removed.
+			constexpr auto eliminate_delta(Node* delta, Node* x) -> Node*
+			{
+				auto [from, to] = delta_rename(delta, x);
+				if (from == to) {
+					return nullptr;
+				}
+
+				release(delta);
+				return rename(x, from, to);
+			}
+
+			/// Detach a Kronecker delta from a tree of products.
+			///
+			/// This looks through outer products (products that don't contract any
+			/// indices) in `node` for a delta that can be removed by contracting it
+			/// with `x`. When one is found `node` is replaced with the product
+			/// without it, and the delta is returned, so that the caller can use
+			/// associativity to form δ * (node * x).
+			constexpr auto extract_delta(Node*& node, Node const* x) -> Node*
+			{
+				if (node->tag != PRODUCT || (node->a_->outer() & node->b_->outer()).size() != 0) {
+					return nullptr;
+				}
+
+				for (bool left : { true, false }) {
+					Node* child = share((left) ? node->a_ : node->b_);
+					Node* delta = nullptr;
+					if (child->tag == INDEX) {
+						auto [from, to] = delta_rename(child, x);
+						delta = (from != to) ? std::exchange(child, nullptr) : nullptr;
+					} else {
+						delta = extract_delta(child, x);
+					}
+
+					if (!delta) {
+						release(child);
+						continue;
+					}
+
+					Node* other = share((left) ? node->b_ : node->a_);
+					release(node);
+					if (child == nullptr) {
+						node = other;
+					} else if (left) {
+						node = make(PRODUCT, child, other);
+					} else {
+						node = make(PRODUCT, other, child);
+					}
+
+					return delta;
+				}
+
+				return nullptr;
+			}
+
+			/// Build the ratio `a / b`.
+			///
+			/// The rational coefficients of the numerator and denominator are folded
+			/// into a coefficient on the ratio. A ratio of equivalent subtrees is
+			/// not folded to 1, as the subtree may be zero at some points.
+			constexpr auto reduce_ratio(Node* a, Node* b) -> Node*
+			{
+				if (a->is_zero()) {
+					release(b);
+					return a;
+				}
+				if (b->is_zero()) {
+					assert(false);
+				}
+				if (b->tag == RATIONAL) {
+					Rational q = b->q.inverse();
+					release(b);
+					return reduce_product(make(q), a);
+				}
+				Factors fa, fb;
+				factor(a, fa);
+				factor(b, fb);
+
+				Rational q = fa.q / fb.q;
+				Node* d = chain(1, fb.nodes);
+				if (fa.nodes.empty()) {
+					return make(RATIO, make(q), d);
+				}
+				return reduce_product(make(q), make(RATIO, chain(1, fa.nodes), d));
+			}
+
+			/// Differentiate a node, taking ownership of it.
+			///
+			/// The derivative of each node with respect to each index is memoized.
+			constexpr auto dx(Node* node, Index const& index) -> Node*
+			{
+				int id = node->id;
+				for (auto const& [i, derivative] : entries[id].derivatives) {
+					if (i == index) {
+						release(node);
+						return share(derivative);
+					}
+				}
+
+				Node* out = differentiate(node, index);
+				entries[id].derivatives.emplace_back(index, share(out));
+				return out;
+			}
+
+			constexpr auto differentiate(Node* node, Index const& index) -> Node*
+			{
+				if (node->constant) {
+					release(node);
+					return make(0);
+				}
+
+				if (node->tag == TENSOR) {
+					if (Definition const* d = find_definition(node->tensor)) {
+						Node* x = instantiate(*d, node->index);
+						release(node);
+						return dx(x, index);
+					}
+
+					Node* out = new Node(*node);
+					out->index += index;
+					release(node);
+					return intern(out);
+				}
+
+				Tag tag = node->tag;
+				Node* a = share(node->a_);
+				Node* b = share(node->b_);
+				release(node);
+
+				switch (tag) {
+				case SUM:
+					return reduce(SUM, dx(a, index), dx(b, index));
+				case DIFFERENCE:
+					return reduce(DIFFERENCE, dx(a, index), dx(b, index));
+				case PRODUCT:
+					return dx_product(a, b, index);
+				case RATIO:
+					return dx_quotient(a, b, index);
+				default:
+					assert(false);
+				}
+				__builtin_unreachable();
+			}
+
+			constexpr auto dx_product(Node* a, Node* b, Index const& index) -> Node*
+			{
+				if (a->constant) {
+					return reduce(PRODUCT, a, dx(b, index));
+				}
+				if (b->constant) {
+					return reduce(PRODUCT, dx(a, index), b);
+				}
+
+				// (a'b + ab')
+				Node* t = reduce(PRODUCT, dx(share(a), index), share(b));
+				Node* u = reduce(PRODUCT, a, dx(b, index));
+				return reduce(SUM, t, u);
+			}
+
+			constexpr auto dx_quotient(Node* a, Node* b, Index const& index) -> Node*
+			{
+				if (b->constant) {
+					return reduce(RATIO, dx(a, index), b);
+				}
+
+				// (a'b - ab')/b^2
+				Node* b2 = reduce(PRODUCT, share(b), share(b));
+				Node* ap_b = reduce(PRODUCT, dx(share(a), index), share(b));
+				Node* a_bp = reduce(PRODUCT, a, dx(b, index));
+				return reduce(RATIO, reduce(DIFFERENCE, ap_b, a_bp), b2);
+			}
+		};
 	};
 }
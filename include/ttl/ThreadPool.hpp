@@ -0,0 +1,209 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stop_token>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace ttl
+{
+	/// A persistent pool of workers for evaluating tiled point ranges.
+	///
+	/// The calling thread participates as worker 0, and the remaining workers
+	/// are std::jthreads that sleep between jobs. A parallel_for() splits its
+	/// range into fixed-size tiles and deals contiguous runs of tiles to each
+	/// worker's queue. In the STEALING schedule a worker that drains its own
+	/// queue goes on to take tiles from the other queues, while in the
+	/// DETERMINISTIC schedule each tile is always executed by the same worker
+	/// for a given range, tile size, and pool size.
+	///
+	/// Jobs must not be submitted concurrently, or from inside of a job.
+	class ThreadPool {
+	public:
+		enum Schedule {
+			STEALING,
+			DETERMINISTIC
+		};
+
+		/// The number of points in each tile.
+		int tile;
+
+		/// The scheduling policy for parallel_for().
+		Schedule schedule;
+
+		explicit ThreadPool(int n_workers = std::thread::hardware_concurrency(),
+			int tile = 1024,
+			Schedule schedule = STEALING)
+			: tile(tile)
+			, schedule(schedule)
+			, n_workers_(std::max(n_workers, 1))
+			, queues_(std::make_unique<Queue[]>(n_workers_))
+		{
+			assert(0 < tile);
+			threads_.reserve(n_workers_ - 1);
+			for (int w = 1; w < n_workers_; ++w) {
+				threads_.emplace_back([this, w](std::stop_token stop) {
+					work(stop, w);
+				});
+			}
+		}
+
+		ThreadPool(ThreadPool const&) = delete;
+		ThreadPool& operator=(ThreadPool const&) = delete;
+
+		~ThreadPool()
+		{
+			for (auto& thread : threads_) {
+				thread.request_stop();
+			}
+			start_.notify_all();
+			threads_.clear();
+		}
+
+		auto size() const -> int
+		{
+			return n_workers_;
+		}
+
+		/// Execute `op(worker, b, e)` for tiles [b, e) that cover [begin, end).
+		///
+		/// The `worker` id is in [0, size()) and can be used to index per-worker
+		/// state, since a worker only ever executes one tile at a time. If `op`
+		/// throws, the first exception is rethrown once all of the workers have
+		/// finished the job.
+		template <class Op>
+		void parallel_for(int begin, int end, Op&& op)
+		{
+			if (end <= begin) {
+				return;
+			}
+
+			int n_tiles = (end - begin + tile - 1) / tile;
+			for (int w = 0; w < n_workers_; ++w) {
+				queues_[w].next = int(std::int64_t(n_tiles) * w / n_workers_);
+				queues_[w].end = int(std::int64_t(n_tiles) * (w + 1) / n_workers_);
+			}
+
+			struct Context {
+				ThreadPool& pool;
+				Op& op;
+				int begin;
+				int end;
+			} context { *this, op, begin, end };
+
+			run(&context, [](void* ptr, int worker) {
+				Context& c = *static_cast<Context*>(ptr);
+				c.pool.drain(worker, [&](int t) {
+					int b = c.begin + t * c.pool.tile;
+					c.op(worker, b, std::min(b + c.pool.tile, c.end));
+				});
+			});
+		}
+
+	private:
+		/// A worker's run of tiles, padded so that workers don't share lines.
+		struct alignas(64) Queue {
+			std::atomic<int> next;
+			int end;
+		};
+
+		using Job = void (*)(void*, int);
+
+		int n_workers_;
+		std::unique_ptr<Queue[]> queues_;
+		std::vector<std::jthread> threads_;
+
+		std::mutex mutex_;
+		std::condition_variable_any start_;
+		std::condition_variable done_;
+		std::uint64_t generation_ = 0;
+		int running_ = 0;
+		Job job_ = nullptr;
+		void* context_ = nullptr;
+		std::exception_ptr error_;
+
+		/// Execute tiles from the worker's own queue, and then (maybe) steal.
+		void drain(int worker, auto&& op)
+		{
+			auto take = [&](Queue& q) {
+				for (int t; (t = q.next.fetch_add(1, std::memory_order_relaxed)) < q.end;) {
+					op(t);
+				}
+			};
+
+			take(queues_[worker]);
+
+			if (schedule == STEALING) {
+				for (int v = 1; v < n_workers_; ++v) {
+					take(queues_[(worker + v) % n_workers_]);
+				}
+			}
+		}
+
+		/// Publish a job to the workers, help out, and wait for it to finish.
+		void run(void* context, Job job)
+		{
+			{
+				std::scoped_lock lock(mutex_);
+				job_ = job;
+				context_ = context;
+				running_ = n_workers_ - 1;
+				++generation_;
+			}
+			start_.notify_all();
+
+			// The workers refer to the caller's context, so they have to finish
+			// before an exception can unwind it.
+			execute(job, context, 0);
+
+			std::unique_lock lock(mutex_);
+			done_.wait(lock, [&] { return running_ == 0; });
+			if (std::exception_ptr error = std::exchange(error_, nullptr)) {
+				std::rethrow_exception(error);
+			}
+		}
+
+		/// Execute a job, and record the first exception that any worker throws.
+		void execute(Job job, void* context, int worker)
+		{
+			try {
+				job(context, worker);
+			} catch (...) {
+				std::scoped_lock lock(mutex_);
+				if (!error_) {
+					error_ = std::current_exception();
+				}
+			}
+		}
+
+		void work(std::stop_token stop, int worker)
+		{
+			std::uint64_t seen = 0;
+			while (true) {
+				std::unique_lock lock(mutex_);
+				if (!start_.wait(lock, stop, [&] { return generation_ != seen; })) {
+					return;
+				}
+				seen = generation_;
+				Job job = job_;
+				void* context = context_;
+				lock.unlock();
+
+				execute(job, context, worker);
+
+				lock.lock();
+				if (--running_ == 0) {
+					done_.notify_one();
+				}
+			}
+		}
+	};
+}
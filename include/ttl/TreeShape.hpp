@@ -14,9 +14,10 @@ namespace ttl
 		int n_inner_indices = 0;
 		int n_tensor_indices = 0;
 		int n_tensor_ids = 0;
-		int dims;
-		int n_indices;
-		int stack_depth;
+		int dims = 0;
+		int n_indices = 0;
+		int n_pattern = 0;
+		int stack_depth = 0;
 
 		struct params_t {
 			int n_scalars {};
@@ -26,9 +27,12 @@ namespace ttl
 			int n_tensor_ids {};
 			int dims;
 			int n_indices;
+			int n_pattern;
 			int stack_depth;
 		};
 
+		constexpr TreeShape() = default;
+
 		constexpr TreeShape(params_t params)
 			: n_scalars(params.n_scalars)
 			, n_immediates(params.n_immediates)
@@ -37,6 +41,7 @@ namespace ttl
 			, n_tensor_ids(params.n_tensor_ids)
 			, dims(params.dims)
 			, n_indices(params.n_indices)
+			, n_pattern(params.n_pattern)
 			, stack_depth(params.stack_depth)
 		{
 		}
@@ -51,7 +56,8 @@ namespace ttl
 			, n_tensor_ids(a.n_tensor_ids + b.n_tensor_ids)
 			, dims(a.dims)
 			, n_indices(a.n_indices + b.n_indices + params.n_indices)
-			, stack_depth(std::max(a.stack_depth, b.stack_depth))
+			, n_pattern(a.n_pattern + b.n_pattern + params.n_pattern)
+			, stack_depth(std::max({ a.stack_depth, b.stack_depth, params.stack_depth }))
 		{
 			assert(a.dims == b.dims);
 		}
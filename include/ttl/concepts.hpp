@@ -9,6 +9,11 @@ namespace ttl
 		typename std::remove_cvref_t<T>::is_equation_tag;
 	};
 
+	template <typename T>
+	concept is_definition = requires {
+		typename std::remove_cvref_t<T>::is_definition_tag;
+	};
+
 	template <typename T>
 	concept is_tree = requires {
 		typename std::remove_cvref_t<T>::is_tree_tag;
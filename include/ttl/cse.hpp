@@ -0,0 +1,308 @@
+#pragma once
+
+#include "ttl/Tensor.hpp"
+#include "ttl/TensorTree.hpp"
+#include <algorithm>
+#include <bit>
+#include <cstdint>
+#include <vector>
+
+namespace ttl
+{
+	/// Common subexpression elimination across the trees in a system.
+	///
+	/// Equations in a system frequently share structure (e.g., the pressure, or
+	/// the divergence of the velocity), but each tree is serialized and
+	/// evaluated independently. This pass repeatedly finds the largest subtree
+	/// that appears more than once, in any of the trees, and moves it into a
+	/// new tree that computes a compiler-generated temporary tensor. Each
+	/// occurrence is replaced with a reference to the temporary.
+	///
+	/// We only consider non-constant, non-leaf subtrees. Occurrences must have
+	/// the same outer index, but the labels that they contract may be named
+	/// differently, so `D(v(k),k)` and `D(v(i),i)` are the same subexpression.
+	struct CommonSubexpressions {
+		using Node = TensorTree::Node;
+
+		struct Candidate {
+			std::uint64_t hash;
+			int size;
+			Node const* node;
+		};
+
+		constexpr static auto mix(std::uint64_t h, std::uint64_t x) -> std::uint64_t
+		{
+			return (h ^ x) * 0x100000001b3;
+		}
+
+		/// Compute a hash that is consistent with matches(), and record each of
+		/// the candidate subtrees along the way.
+		///
+		/// The hash of a subtree doesn't depend on the names of its index labels,
+		/// as these can be renamed. The outer labels of a candidate can't be
+		/// renamed, so they are mixed into its recorded hash.
+		constexpr static auto hash(Node const* node, std::vector<Candidate>& out) -> std::uint64_t
+		{
+			std::uint64_t h = mix(0xcbf29ce484222325, node->tag);
+			h = mix(h, node->index.size());
+			h = mix(h, node->constant);
+
+			switch (node->tag) {
+			case SUM:
+			case DIFFERENCE:
+			case PRODUCT:
+			case RATIO:
+				h = mix(h, hash(node->a(), out));
+				h = mix(h, hash(node->b(), out));
+				if (!node->constant) {
+					std::uint64_t outer = h;
+					for (char c : node->outer()) {
+						outer = mix(outer, c);
+					}
+					out.push_back({ outer, node->size, node });
+				}
+				return h;
+
+			case DOUBLE:
+				return mix(h, std::bit_cast<std::uint64_t>(node->d));
+
+			case RATIONAL:
+				return mix(mix(h, node->q.p), node->q.q);
+
+			case TENSOR:
+				for (char c : node->tensor.id()) {
+					h = mix(h, c);
+				}
+				return mix(h, node->tensor.order());
+
+			default:
+				return h;
+			}
+		}
+
+		/// A one-to-one renaming of index labels.
+		using Renaming = std::vector<std::pair<char, char>>;
+
+		/// Check to see if `x` and `y` are the same up to the renaming, extending
+		/// the renaming with the labels that haven't been seen yet.
+		constexpr static bool matches(Node const* x, Node const* y, Renaming& renaming)
+		{
+			if (x->tag != y->tag || x->constant != y->constant || x->index.size() != y->index.size()) {
+				return false;
+			}
+
+			for (int n = 0; n < x->index.size(); ++n) {
+				char a = x->index[n];
+				char b = y->index[n];
+				auto i = std::find_if(renaming.begin(), renaming.end(), [&](auto const& r) {
+					return r.first == a || r.second == b;
+				});
+				if (i == renaming.end()) {
+					renaming.emplace_back(a, b);
+				} else if (i->first != a || i->second != b) {
+					return false;
+				}
+			}
+
+			switch (x->tag) {
+			case SUM:
+			case DIFFERENCE:
+			case PRODUCT:
+			case RATIO:
+				return matches(x->a(), y->a(), renaming) && matches(x->b(), y->b(), renaming);
+			case DOUBLE:
+				return x->d == y->d;
+			case RATIONAL:
+				return x->q == y->q;
+			case TENSOR:
+				return x->tensor == y->tensor;
+			default:
+				return true;
+			}
+		}
+
+		/// Check to see if `x` and `y` are the same subexpression, i.e., if they
+		/// have the same outer index and are the same up to a consistent renaming
+		/// of the labels they contract.
+		///
+		/// The outer labels are fixed first, so a contracted label can never be
+		/// renamed to one of them. A label that is reused for two different
+		/// contractions must be reused in the same way in both subtrees, which
+		/// can miss some matches but never finds a false one.
+		constexpr static bool matches(Node const* x, Node const* y)
+		{
+			if (x == y) {
+				return true;
+			}
+
+			Index outer = x->outer();
+			if (outer != y->outer()) {
+				return false;
+			}
+
+			Renaming renaming;
+			for (char c : outer) {
+				renaming.emplace_back(c, c);
+			}
+			return matches(x, y, renaming);
+		}
+
+		/// Find the largest subtree that appears at least twice.
+		constexpr static auto find(std::vector<TensorTree> const& trees) -> Node const*
+		{
+			std::vector<Candidate> candidates;
+			for (TensorTree const& tree : trees) {
+				hash(tree.root(), candidates);
+			}
+
+			std::sort(candidates.begin(), candidates.end(), [](Candidate const& a, Candidate const& b) {
+				return (a.size != b.size) ? a.size > b.size : a.hash < b.hash;
+			});
+
+			for (auto i = candidates.begin(), e = candidates.end(); i != e; ++i) {
+				for (auto j = i + 1; j != e && j->size == i->size && j->hash == i->hash; ++j) {
+					if (matches(i->node, j->node)) {
+						return i->node;
+					}
+				}
+			}
+
+			return nullptr;
+		}
+
+		/// Replace all of the occurrences of `pattern` with a reference to `t`.
+		///
+		/// Subtrees may be shared (see TensorTree::Builder_), and are updated in
+		/// place, which replaces the occurrences in every tree that shares them.
+		constexpr static auto replace(Node*& node, Node const* pattern, Tensor const& t) -> int
+		{
+			if (node->size == pattern->size && matches(node, pattern)) {
+				release(node);
+				node = new Node(t, pattern->outer(), false);
+				return 1;
+			}
+
+			if (!tag_is_binary(node->tag) || node->size < pattern->size) {
+				return 0;
+			}
+
+			int n = replace(node->a_, pattern, t) + replace(node->b_, pattern, t);
+			node->size = node->a_->size + node->b_->size + 1;
+			node->invalidate();
+			return n;
+		}
+
+		/// Check to see if the subtree refers to the tensor `t`.
+		constexpr static bool refers_to(Node const* node, Tensor const& t)
+		{
+			if (node->tag == TENSOR) {
+				return node->tensor == t;
+			}
+			if (tag_is_binary(node->tag)) {
+				return refers_to(node->a(), t) || refers_to(node->b(), t);
+			}
+			return false;
+		}
+
+		/// Eliminate the common subexpressions in a vector of trees.
+		///
+		/// The trees that compute the temporaries are inserted at the front of
+		/// the vector, ordered so that each temporary only refers to the
+		/// temporaries before it.
+		///
+		/// The first `n_definitions` trees compute definitions that the other
+		/// trees may refer to. A temporary can refer to a definition and vice
+		/// versa, so they are sorted together with the temporaries, and the
+		/// remaining trees follow them in their original order.
+		///
+		/// @returns The number of temporaries.
+		constexpr static auto eliminate(std::vector<TensorTree>& trees, int n_definitions = 0) -> int
+		{
+			int n_trees = trees.size();
+			for (int k = 0; Node const* node = find(trees); ++k) {
+				// The clone shares its children with the trees, but replace() never
+				// rewrites a subtree that is smaller than the pattern.
+				Node* pattern = clone(node);
+				Tensor t = temporary(k, pattern->order());
+				for (TensorTree& tree : trees) {
+					replace(tree.root_, pattern, t);
+				}
+				trees.emplace_back(t, pattern);
+			}
+
+			int n_temporaries = trees.size() - n_trees;
+
+			// Topologically sort the temporaries and definitions.
+			std::vector<int> pending;
+			for (int i = 0; i < n_definitions; ++i) {
+				pending.push_back(i);
+			}
+			for (int k = 0; k < n_temporaries; ++k) {
+				pending.push_back(n_trees + k);
+			}
+
+			std::vector<TensorTree> out;
+			std::vector<int> done(trees.size());
+			while (int(out.size()) < int(pending.size())) {
+				for (int k : pending) {
+					if (done[k]) {
+						continue;
+					}
+
+					TensorTree& tree = trees[k];
+					bool ready = true;
+					for (int j : pending) {
+						if (!done[j] && j != k && refers_to(tree.root(), trees[j].lhs())) {
+							ready = false;
+						}
+					}
+
+					if (ready) {
+						out.push_back(std::move(tree));
+						done[k] = true;
+					}
+				}
+			}
+
+			for (int i = n_definitions; i < n_trees; ++i) {
+				out.push_back(std::move(trees[i]));
+			}
+
+			trees = std::move(out);
+			return n_temporaries;
+		}
+
+		/// Remove the temporaries and definitions that are never read.
+		///
+		/// The first `n_intermediates` trees compute temporaries and definitions,
+		/// in the order that eliminate() leaves them, so any tree that reads
+		/// one comes after it. A definition that is only used through its
+		/// derivatives has been expanded with the chain rule, so its own value
+		/// would be computed at every point and thrown away. The trees are
+		/// visited backwards so that removing a tree can also remove the trees
+		/// that only it reads.
+		///
+		/// @returns The number of trees that were removed.
+		constexpr static auto prune(std::vector<TensorTree>& trees, int n_intermediates) -> int
+		{
+			std::vector<bool> used(trees.size(), true);
+			for (int k = n_intermediates - 1; k >= 0; --k) {
+				used[k] = false;
+				for (int j = k + 1; j < int(trees.size()) && !used[k]; ++j) {
+					used[k] = used[j] && refers_to(trees[j].root(), trees[k].lhs());
+				}
+			}
+
+			std::vector<TensorTree> out;
+			for (int k = 0; k < int(trees.size()); ++k) {
+				if (used[k]) {
+					out.push_back(std::move(trees[k]));
+				}
+			}
+
+			int n = trees.size() - out.size();
+			trees = std::move(out);
+			return n;
+		}
+	};
+}
@@ -6,6 +6,8 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <format>
+#include <string_view>
 #include <utility>
 
 namespace ttl::exec
@@ -50,6 +52,22 @@ namespace ttl::exec
 			return e - i;
 		}
 
+		constexpr auto count(char c) const -> int
+		{
+			return std::count(i, e, c);
+		}
+
+		/// Check to see if no character appears more than once.
+		constexpr bool is_unique() const
+		{
+			for (auto ii = i; ii < e; ++ii) {
+				if (std::count(ii + 1, e, *ii)) {
+					return false;
+				}
+			}
+			return true;
+		}
+
 		constexpr auto index_of(char c) const -> int
 		{
 			for (auto ii = i; ii < e; ++ii) {
@@ -75,4 +93,55 @@ namespace ttl::exec
 		return out;
 	}
 
+	/// The stride of each of the `from` characters in the layout of `to` (see
+	/// ScalarIndex::row_major()).
+	///
+	/// This is the loop-nest equivalent of make_map(): a nest of loops over
+	/// `from` that advances by `out[d]` in the `d`th loop visits the same
+	/// elements of `to` as the map, without a table lookup. Characters that
+	/// `to` doesn't use have a stride of 0. Neither index may repeat a
+	/// character, since a repeated character would need the sum of its
+	/// strides and index_of() only finds the first.
+	template <int N, int M>
+	constexpr auto make_strides(Index const& from, Index const& to)
+		-> std::array<int, M>
+	{
+		assert(from.size() == M);
+		assert(from.is_unique() && to.is_unique());
+		std::array<int, M> out{};
+		for (int d = 0; d < M; ++d) {
+			if (to.count(from[d])) {
+				out[d] = ttl::pow(N, to.index_of(from[d]));
+			}
+		}
+		return out;
+	}
+
 } // namespace exec
+
+template <>
+struct std::formatter<ttl::exec::Tag> : std::formatter<std::string_view> {
+	constexpr static const char* tag_strings[] = {
+		"sum",
+		"difference",
+		"product",
+		"ratio",
+		"immediate",
+		"scalar",
+		"constant",
+		"delta"
+	};
+
+	auto format(ttl::exec::Tag tag, auto& ctx) const
+	{
+		return std::formatter<std::string_view>::format(tag_strings[tag], ctx);
+	}
+};
+
+template <>
+struct std::formatter<ttl::exec::Index> : std::formatter<std::string_view> {
+	auto format(ttl::exec::Index const& index, auto& ctx) const
+	{
+		return std::formatter<std::string_view>::format(std::string_view(index.i, index.e), ctx);
+	}
+};
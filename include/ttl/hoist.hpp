@@ -0,0 +1,102 @@
+#pragma once
+
+#include "ttl/Tensor.hpp"
+#include "ttl/TensorTree.hpp"
+#include "ttl/cse.hpp"
+#include <vector>
+
+namespace ttl
+{
+	/// Hoist constant subtrees out of the per-point evaluation.
+	///
+	/// Subtrees that only depend on constants and immediates (e.g., `2 * μ` or
+	/// `(γ - 1)`) evaluate to the same value at every point. This pass replaces
+	/// each maximal constant subtree that does any arithmetic with a reference
+	/// to a compiler-generated constant tensor, and creates a tree that
+	/// computes that tensor. The constant trees are evaluated once, when the
+	/// constants are bound, rather than once per point.
+	struct ConstantSubexpressions {
+		using Node = TensorTree::Node;
+
+		/// Check to see if `node` is the hoisted `root` with its outer labels
+		/// renamed.
+		///
+		/// The hoisted tree computes `t(root->outer())`, so `node` can be replaced
+		/// with `t(node->outer())` whenever the outer labels correspond by
+		/// position, e.g., `c * K(a, b)` and `c * K(i, j)`, or `c * K(j, i)` with
+		/// outer index `ji`. The contracted labels can be renamed as in
+		/// CommonSubexpressions::matches().
+		constexpr static bool matches(Node const* root, Node const* node)
+		{
+			if (root == node) {
+				return true;
+			}
+
+			Index x = root->outer();
+			Index y = node->outer();
+			if (x.size() != y.size()) {
+				return false;
+			}
+
+			CommonSubexpressions::Renaming renaming;
+			for (int n = 0; n < x.size(); ++n) {
+				renaming.emplace_back(x[n], y[n]);
+			}
+			return CommonSubexpressions::matches(root, node, renaming);
+		}
+
+		constexpr static void hoist(Node*& node, std::vector<TensorTree>& constants, int& k)
+		{
+			if (!tag_is_binary(node->tag)) {
+				return;
+			}
+
+			if (!node->constant) {
+				hoist(node->a_, constants, k);
+				hoist(node->b_, constants, k);
+				node->size = node->a_->size + node->b_->size + 1;
+				node->invalidate();
+				return;
+			}
+
+			Index outer = node->outer();
+
+			// Reuse a constant if we've already hoisted one that computes the same
+			// thing.
+			for (TensorTree const& tree : constants) {
+				if (matches(tree.root(), node)) {
+					Tensor t = tree.lhs();
+					release(node);
+					node = new Node(t, outer, true);
+					return;
+				}
+			}
+
+			Tensor t = temporary(k++, outer.size());
+			constants.emplace_back(t, node);
+			node = new Node(t, outer, true);
+		}
+
+		/// Hoist the constant subtrees in a vector of trees.
+		///
+		/// The constant trees are inserted at the front of the vector. The
+		/// generated tensors are numbered starting with the `k`th temporary.
+		///
+		/// @returns The number of constant trees.
+		constexpr static auto hoist(std::vector<TensorTree>& trees, int k) -> int
+		{
+			std::vector<TensorTree> out;
+			for (TensorTree& tree : trees) {
+				hoist(tree.root_, out, k);
+			}
+
+			int n_constants = out.size();
+			for (TensorTree& tree : trees) {
+				out.push_back(std::move(tree));
+			}
+
+			trees = std::move(out);
+			return n_constants;
+		}
+	};
+}
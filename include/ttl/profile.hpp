@@ -0,0 +1,71 @@
+#pragma once
+
+#include <chrono>
+#include <concepts>
+#include <cstdint>
+#include <string_view>
+#include <type_traits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+namespace ttl::profile
+{
+	/// Policies for instrumenting evaluation.
+	///
+	/// A profile is passed to ExecutableSystem::evaluate() after the update
+	/// policy. The default is `none`, for which evaluation is exactly the
+	/// uninstrumented code. Otherwise each node of each tree is timed, and the
+	/// counts are recorded in the system's `Profile` (see
+	/// ExecutableSystem::Profile).
+
+	/// No instrumentation.
+	struct none {
+	};
+
+	template <class P>
+	constexpr bool is_enabled = not std::same_as<std::remove_cvref_t<P>, none>;
+
+	/// The current value of the cycle counter.
+	///
+	/// This is the time stamp counter where we have one, otherwise it falls
+	/// back to the steady clock in nanoseconds (see `unit`).
+	inline auto clock() -> std::uint64_t
+	{
+#if defined(__x86_64__) || defined(__i386__)
+		return __rdtsc();
+#else
+		auto t = std::chrono::steady_clock::now().time_since_epoch();
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(t).count();
+#endif
+	}
+
+	/// The unit of clock(), for labelling reports.
+#if defined(__x86_64__) || defined(__i386__)
+	inline constexpr std::string_view unit = "cycles";
+#else
+	inline constexpr std::string_view unit = "ns";
+#endif
+
+	/// The accumulated cycles and invocations of a node or a tree.
+	///
+	/// The `cycles` are in the unit of clock().
+	struct Counter {
+		std::uint64_t cycles = 0;
+		std::uint64_t count = 0;
+
+		constexpr void add(std::uint64_t n)
+		{
+			cycles += n;
+			count += 1;
+		}
+
+		constexpr auto operator+=(Counter const& b) -> Counter&
+		{
+			cycles += b.cycles;
+			count += b.count;
+			return *this;
+		}
+	};
+}
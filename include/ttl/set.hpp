@@ -1,6 +1,9 @@
 #pragma once
 
+#include <algorithm>
+#include <numeric>
 #include <optional>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -8,25 +11,54 @@
 
 namespace ttl
 {
+	/// A set that numbers its elements in insertion order.
+	///
+	/// The position of an element is used as its id (e.g., the scalar ids), so
+	/// elements stay where they are inserted. Lookups go through `order_`, the
+	/// positions sorted by value, so find(), contains(), and emplace() make
+	/// O(log n) comparisons. Pointers can't be ordered during constant
+	/// evaluation, so sets of pointers fall back to a linear search.
 	template <typename T>
-	struct set : std::vector<T> {
-		using set::vector::vector;
+	struct set : private std::vector<T> {
+		using vector = std::vector<T>;
+		using typename vector::value_type;
+		using typename vector::const_iterator;
+		using vector::size;
+		using vector::empty;
 
-		constexpr bool contains(const T& value) const
+		constexpr static bool ordered = not std::is_pointer_v<T>;
+
+		constexpr set() = default;
+
+		// Only const access is exposed, since writing through an element would
+		// leave it out of order in `order_`.
+		constexpr auto begin() const -> const_iterator
 		{
-			for (auto&& t : *this) {
-				if (t == value)
-					return true;
-			}
-			return false;
+			return vector::begin();
+		}
+
+		constexpr auto end() const -> const_iterator
+		{
+			return vector::end();
+		}
+
+		constexpr auto operator[](std::size_t i) const -> T const&
+		{
+			return vector::operator[](i);
 		}
 
 		constexpr auto find(T const& t) const -> std::optional<int>
 		{
-			// set's aren't sorted
-			for (auto i = this->begin(), e = this->end(); i != e; ++i) {
-				if (*i == t) {
-					return std::distance(this->begin(), i);
+			if constexpr (ordered) {
+				auto i = lower_bound(t);
+				if (i != order_.end() and (*this)[*i] == t) {
+					return *i;
+				}
+			} else {
+				for (auto i = begin(), e = end(); i != e; ++i) {
+					if (*i == t) {
+						return std::distance(begin(), i);
+					}
 				}
 			}
 			return std::nullopt;
@@ -38,20 +70,51 @@ namespace ttl
 			return find(T(std::forward<Ts>(ts)...));
 		}
 
+		constexpr bool contains(const T& value) const
+		{
+			return find(value).has_value();
+		}
+
 		template <typename... Ts>
 		constexpr bool emplace(Ts&&... ts)
 		{
 			T temp(std::forward<Ts>(ts)...);
-			if (!contains(temp)) {
-				this->push_back(std::move(temp));
-				return true;
+			if constexpr (ordered) {
+				auto i = lower_bound(temp);
+				if (i != order_.end() and (*this)[*i] == temp) {
+					return false;
+				}
+				order_.insert(i, size());
+			} else if (contains(temp)) {
+				return false;
+			}
+			this->push_back(std::move(temp));
+			return true;
+		}
+
+		/// Insert a range of values.
+		///
+		/// The values that aren't already in the set are appended in order. This
+		/// sorts the index once for the whole range rather than inserting each
+		/// value into it, so it's the cheap way to add values that contain a lot
+		/// of duplicates.
+		constexpr void insert(auto first, auto last)
+		{
+			if constexpr (ordered) {
+				vector::insert(end(), first, last);
+				unique();
+			} else {
+				for (; first != last; ++first) {
+					emplace(*first);
+				}
 			}
-			return false;
 		}
 
 		constexpr auto sort() -> set&
 		{
-			std::sort(this->begin(), this->end());
+			std::sort(vector::begin(), vector::end());
+			order_.resize(size());
+			std::iota(order_.begin(), order_.end(), 0);
 			return *this;
 		}
 
@@ -63,5 +126,55 @@ namespace ttl
 			std::copy_n(self.begin(), M, out.begin());
 			return out;
 		}
+
+	private:
+		std::vector<int> order_; //!< the positions of the elements, sorted by value
+
+		constexpr auto lower_bound(T const& t) const
+		{
+			return std::lower_bound(order_.begin(), order_.end(), t, [&](int i, T const& t) {
+				return (*this)[i] < t;
+			});
+		}
+
+		/// Rebuild the index and remove all but the first of each run of equal
+		/// elements.
+		constexpr void unique()
+		{
+			std::vector<int> order(size());
+			std::iota(order.begin(), order.end(), 0);
+			std::sort(order.begin(), order.end(), [&](int a, int b) {
+				T const& x = (*this)[a];
+				T const& y = (*this)[b];
+				return (x < y) or (not(y < x) and a < b);
+			});
+
+			std::vector<char> keep(size(), true);
+			for (std::size_t k = 1; k < order.size(); ++k) {
+				if ((*this)[order[k]] == (*this)[order[k - 1]]) {
+					keep[order[k]] = false;
+				}
+			}
+
+			// Compact the elements, and renumber the index to match.
+			std::vector<int> id(size());
+			int m = 0;
+			for (int i = 0; i < int(size()); ++i) {
+				if (keep[i]) {
+					if (m != i) {
+						vector::operator[](m) = std::move(vector::operator[](i));
+					}
+					id[i] = m++;
+				}
+			}
+			vector::erase(vector::begin() + m, vector::end());
+
+			order_.clear();
+			for (int i : order) {
+				if (keep[i]) {
+					order_.push_back(id[i]);
+				}
+			}
+		}
 	};
 }
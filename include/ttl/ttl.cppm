@@ -1,33 +1,76 @@
 module;
+#include "ttl/Dual.hpp"
 #include "ttl/Equation.hpp"
 #include "ttl/ExecutableSystem.hpp"
 #include "ttl/Index.hpp"
+#include "ttl/Pack.hpp"
+#include "ttl/RungeKutta.hpp"
+#include "ttl/Stencil.hpp"
 #include "ttl/System.hpp"
 #include "ttl/Tensor.hpp"
 #include "ttl/TensorTree.hpp"
+#include "ttl/ThreadPool.hpp"
 #include "ttl/dot.hpp"
 #include "ttl/grammar.hpp"
+#include "ttl/update.hpp"
 export module ttl;
 
 export namespace ttl
 {
+	using ttl::central_difference;
+	using ttl::central_radius;
 	using ttl::D;
 	using ttl::delta;
 	using ttl::dot;
+	using ttl::Dual;
+	using ttl::Definition;
 	using ttl::Equation;
 	using ttl::ExecutableSystem;
 	using ttl::Index;
 	using ttl::is_tree;
+	using ttl::let;
 	using ttl::matrix;
+	using ttl::Pack;
+	using ttl::RungeKutta;
 	using ttl::scalar;
+	using ttl::set;
 	using ttl::symmetrize;
 	using ttl::System;
 	using ttl::Tensor;
 	using ttl::TensorTree;
+	using ttl::ThreadPool;
 	using ttl::vector;
 
 	using ttl::operator+;
 	using ttl::operator*;
 	using ttl::operator-;
 	using ttl::operator/;
+}
+
+export namespace ttl::exec
+{
+	using ttl::exec::Tag;
+	using ttl::exec::SUM;
+	using ttl::exec::DIFFERENCE;
+	using ttl::exec::PRODUCT;
+	using ttl::exec::RATIO;
+	using ttl::exec::IMMEDIATE;
+	using ttl::exec::SCALAR;
+	using ttl::exec::CONSTANT;
+	using ttl::exec::DELTA;
+}
+
+export namespace ttl::rk
+{
+	using ttl::rk::Euler;
+	using ttl::rk::SSPRK3;
+	using ttl::rk::RK4;
+	using ttl::rk::LSRK54;
+}
+
+export namespace ttl::update
+{
+	using ttl::update::assign;
+	using ttl::update::axpby;
+	using ttl::update::axpy;
 }
\ No newline at end of file
@@ -0,0 +1,64 @@
+#pragma once
+
+namespace ttl::update
+{
+	/// Policies for writing a right-hand-side into an output.
+	///
+	/// An update is called as `update(out, rhs, id, i)` for each left-hand-side
+	/// component `id` of each point `i`, where `out` is the reference returned
+	/// by the user's output accessor. Fusing the update into evaluation means
+	/// that a time stepper doesn't need a separate pass over the state.
+	///
+	/// The outputs of a point are written while other points are still being
+	/// evaluated, and the scalars accessor may read the neighbors of a point
+	/// (e.g., through a ttl::Stencil). The output must therefore never alias
+	/// anything that the scalars accessor reads, which means that the state
+	/// can't be updated in place.
+
+	/// out = rhs
+	struct assign {
+		constexpr void operator()(auto& out, auto const& rhs, int, int) const
+		{
+			out = rhs;
+		}
+	};
+
+	/// out += dt * rhs
+	///
+	/// The `out` must be a separate register from the state that the scalars
+	/// accessor reads, e.g., the increment of a low-storage scheme.
+	template <class T>
+	struct axpy {
+		T dt;
+
+		constexpr void operator()(auto& out, auto const& rhs, int, int) const
+		{
+			out += dt * rhs;
+		}
+	};
+
+	/// out = a * u(id, i) + b * rhs
+	///
+	/// The `u` accessor reads a register of the state (e.g., the state at the
+	/// start of the step, u^n), which may also be what the scalars accessor
+	/// reads since `u` is only read. The `out` must be a different register,
+	/// so a stage of an explicit Runge-Kutta scheme in Shu-Osher form such as
+	/// `u^(1) = u^n + dt * f(u^n)` reads u^n and writes u^(1).
+	template <class T, class U>
+	struct axpby {
+		T a;
+		T b;
+		U u;
+
+		constexpr void operator()(auto& out, auto const& rhs, int id, int i) const
+		{
+			out = a * u(id, i) + b * rhs;
+		}
+	};
+
+	template <class T>
+	axpy(T) -> axpy<T>;
+
+	template <class T, class U>
+	axpby(T, T, U) -> axpby<T, U>;
+}
@@ -1,4 +1,8 @@
+#include "ns.hpp"
+#include <kumi/tuple.hpp>
+
 import ttl;
+import std;
 
 namespace
 {
@@ -8,15 +12,972 @@ namespace
 
 	constexpr ttl::Index i = 'i';
 	constexpr ttl::Index j = 'j';
+	constexpr ttl::Index k = 'k';
 
 	constexpr ttl::System test = {
 		C <<= A(i, j) + B(i, j)
 	};
 
 	[[maybe_unused]] constexpr ttl::ExecutableSystem<double, 3, test> test3d;
+
+	constexpr ttl::Tensor p = ttl::scalar("p");
+	constexpr ttl::Tensor u = ttl::vector("u");
+
+	// u(i)*u(i) and u(k)*u(k) only differ in the name of the label that they
+	// contract, so they are computed once, by a single temporary.
+	constexpr ttl::System shared = {
+		p <<= u(i) * u(i) + p,
+		u <<= u(k) * u(k) * u(j)
+	};
+
+	constexpr ttl::ExecutableSystem<double, 3, shared> shared3d;
+	static_assert(shared3d.n_trees == shared3d.n_equations + 1);
+
+	// θ and q are only read through their derivatives, which are expanded with
+	// the chain rule, so they don't get trees. Only p and σ are computed per
+	// point.
+	constexpr ttl::ExecutableSystem<double, 3, ns::navier_stokes> ns3d;
+	static_assert([] {
+		int n = 0;
+		for (int t = ns3d.first_point_tree; t < ns3d.first_point_tree + ns3d.n_temporaries; ++t) {
+			if (ns3d.lhs[t] == ns::θ || ns3d.lhs[t] == ns::q) {
+				return false;
+			}
+			n += ns::navier_stokes.is_defined(ns3d.lhs[t]);
+		}
+		return n == 2;
+	}());
+
+	/// A set with duplicates inserted both one at a time and as a range.
+	constexpr auto numbered = [] {
+		ttl::set<int> s;
+		for (int x : { 5, 3, 5, 9, 3, 1 }) {
+			s.emplace(x);
+		}
+		std::array more = { 9, 7, 1, 7, 2 };
+		s.insert(more.begin(), more.end());
+		return s;
+	};
+
+	// The ids stay in insertion order, and the duplicates don't get ids.
+	static_assert([] {
+		auto s = numbered();
+		std::array expected = { 5, 3, 9, 1, 7, 2 };
+		if (s.size() != expected.size()) {
+			return false;
+		}
+		for (std::size_t n = 0; n < expected.size(); ++n) {
+			if (s[n] != expected[n]) {
+				return false;
+			}
+		}
+		return true;
+	}());
+
+	// find() agrees with a linear search, for values in and out of the set.
+	static_assert([] {
+		auto s = numbered();
+		for (int x = -1; x < 11; ++x) {
+			int linear = -1;
+			for (int n = 0; n < int(s.size()); ++n) {
+				if (s[n] == x) {
+					linear = n;
+					break;
+				}
+			}
+			if (s.find(x).value_or(-1) != linear || s.contains(x) != (linear >= 0)) {
+				return false;
+			}
+		}
+		return true;
+	}());
+
+	// The second order centered stencils.
+	static_assert(ttl::central_radius(2, 2) == 1);
+	static_assert([] {
+		auto w = ttl::central_difference(2, 2);
+		return w.size() == 3 && w[0] == 1 && w[1] == -2 && w[2] == 1;
+	}());
+	static_assert([] {
+		auto w = ttl::central_difference(1, 2);
+		return w.size() == 3 && w[0] == -0.5 && w[1] == 0 && w[2] == 0.5;
+	}());
+
+	constexpr ttl::Tensor a = ttl::scalar("a");
+	constexpr ttl::Tensor b = ttl::scalar("b");
+	constexpr ttl::Tensor c = ttl::scalar("c");
+
+	constexpr auto non_constant = [](ttl::Tensor const&) {
+		return false;
+	};
+
+	// Identical subexpressions are interned into a single node.
+	static_assert([] {
+		ttl::TensorTree t(c, (a + b) * (a + b), non_constant);
+		return t.root()->a() == t.root()->b();
+	}());
+
+	// Once the builder is gone the nodes are owned by their parents, and a
+	// shared node has one owner for each use. Any imbalance in share() and
+	// release() would leak or double delete, which isn't a constant expression.
+	static_assert([] {
+		ttl::TensorTree t(c, (a + b) * (a + b), non_constant);
+		auto const* sum = t.root()->a();
+		return t.root()->refs == 1 && sum->refs == 2 && sum->a()->refs == 1 && sum->b()->refs == 1;
+	}());
+
+	// Commutative products have a single canonical form, so these cancel.
+	static_assert([] {
+		ttl::TensorTree t(c, a * b - b * a, non_constant);
+		return t.root()->is_zero();
+	}());
+
+	// Like terms are collected.
+	static_assert([] {
+		ttl::TensorTree x(c, 2 * a + 3 * a, non_constant);
+		ttl::TensorTree y(c, 5 * a, non_constant);
+		return is_equivalent(x.root(), y.root());
+	}());
+
+	// a/a isn't folded, since a may be zero.
+	static_assert([] {
+		ttl::TensorTree t(c, a / a, non_constant);
+		return not t.root()->is_one();
+	}());
+
+	// A Kronecker delta is removed by renaming the label that it contracts.
+	static_assert([] {
+		ttl::TensorTree x(C, ttl::delta(i, j) * A(j, k), non_constant);
+		ttl::TensorTree y(C, A(i, k), non_constant);
+		return is_equivalent(x.root(), y.root());
+	}());
+
+	// When both of its labels are free in the other factor it becomes a trace.
+	static_assert([] {
+		ttl::TensorTree x(c, ttl::delta(i, j) * A(i, j), non_constant);
+		ttl::TensorTree y(c, A(i, i), non_constant);
+		return is_equivalent(x.root(), y.root());
+	}());
+
+	// δ(i,j)δ(j,k) = δ(i,k).
+	static_assert([] {
+		ttl::TensorTree x(C, ttl::delta(i, j) * ttl::delta(j, k), non_constant);
+		ttl::TensorTree y(C, ttl::delta(i, k), non_constant);
+		return is_equivalent(x.root(), y.root());
+	}());
+
+	// The contraction is evaluated before the scalar that scales it, and the
+	// operands of the contraction are released before the scalar is loaded.
+	// In the order the tree is written the scalar would stay live during the
+	// contraction, which needs 28 slots for N = 3 rather than 27.
+	static_assert([] {
+		ttl::TensorTree t(C, a * (A(i, j) * B(j, k)), non_constant);
+		return t.root()->a()->order() == 0 && t.root()->b_first(3) && t.shape(3).stack_depth == 27;
+	}());
+
+	/// The id of the scalar for the component `n` of the tensor `t`, or -1.
+	constexpr auto scalar_id = [](auto const& system, ttl::Tensor const& t, int n = 0) {
+		for (int id = 0; id < int(system.scalars.size()); ++id) {
+			auto const& s = system.scalars[id];
+			if (s.tensor == t && s.order == 0 && (t.order() == 0 || s.index[0] == n)) {
+				return id;
+			}
+		}
+		return -1;
+	};
+
+	constexpr ttl::Tensor x = ttl::scalar("x");
+	constexpr ttl::Tensor y = ttl::scalar("y");
+
+	// x' = a x y and y' = x - y y, so the Jacobian is
+	//
+	//   | a y   a x  |
+	//   | 1    -2 y  |
+	constexpr ttl::System coupled = {
+		x <<= a * x * y,
+		y <<= x - y * y
+	};
+
+	constexpr ttl::ExecutableSystem<double, 2, coupled> coupled2d;
+
+	// Every entry is structurally nonzero, and they match the hand-derived
+	// Jacobian at x = 3, y = 5, and a = 2.
+	static_assert([] {
+		constexpr int ix = scalar_id(coupled2d, x);
+		constexpr int iy = scalar_id(coupled2d, y);
+		auto const& pattern = coupled2d.jacobian_pattern<>;
+		if (ix < 0 || iy < 0 || pattern.size() != 4 || coupled2d.constants.size() != 1) {
+			return false;
+		}
+
+		std::array<double, 4> jac {};
+		coupled2d.evaluate_jacobian(
+			0, 1,
+			[&](int id, int) { return (id == ix) ? 3.0 : 5.0; },
+			[](int) { return 2.0; },
+			[&](int k, int) -> double& { return jac[k]; });
+
+		std::array<std::array<double, 2>, 2> expected = { { { 10, 6 }, { 1, -10 } } };
+		int seen = 0;
+		for (int k = 0; k < 4; ++k) {
+			auto [c, id] = pattern[k];
+			int row = (coupled2d.outputs[c] == ix) ? 0 : 1;
+			int col = (id == ix) ? 0 : 1;
+			seen |= 1 << (2 * row + col);
+			if (jac[k] != expected[row][col]) {
+				return false;
+			}
+		}
+		return seen == 0b1111;
+	}());
+
+	// Each equation is simplified by its own builder, which interns x and y in
+	// a different order, but x y and y x still have one canonical form, so
+	// they share a temporary.
+	constexpr ttl::System commuted = {
+		x <<= x * y + x,
+		y <<= y * x - y
+	};
+
+	constexpr ttl::ExecutableSystem<double, 2, commuted> commuted2d;
+	static_assert(commuted2d.n_trees == commuted2d.n_equations + 1);
+
+	// The adjoint of p' = a u(i) u(i) and u' = b u, for an objective whose
+	// derivatives with respect to p' and u' are λp and λu, is
+	//
+	//   ∂/∂a = λp u(i) u(i)
+	//   ∂/∂b = λu(i) u(i)
+	constexpr ttl::System quadratic = {
+		p <<= a * u(i) * u(i),
+		u <<= b * u(j)
+	};
+
+	constexpr ttl::ExecutableSystem<double, 3, quadratic> quadratic3d;
+
+	static_assert([] {
+		auto constant_id = [](ttl::Tensor const& t) {
+			for (int id = 0; id < int(quadratic3d.constants.size()); ++id) {
+				if (quadratic3d.constants[id].tensor == t) {
+					return id;
+				}
+			}
+			return -1;
+		};
+
+		int ia = constant_id(a);
+		int ib = constant_id(b);
+		if (ia < 0 || ib < 0 || quadratic3d.constants.size() != 2 || quadratic3d.adjoint_constant_ids<>.size() != 2) {
+			return false;
+		}
+
+		auto value = [](int id, int) { return 1.0 + id; };
+		auto adjoint = [](int id, int) { return 1.0 + 2 * id; };
+
+		double da = 0;
+		double db = 0;
+		for (int id = 0; id < int(quadratic3d.scalars.size()); ++id) {
+			if (quadratic3d.scalars[id].tensor == u) {
+				da += value(id, 0) * value(id, 0);
+				db += adjoint(id, 0) * value(id, 0);
+			}
+		}
+		da *= adjoint(scalar_id(quadratic3d, p), 0);
+
+		std::array<double, 2> gradient {};
+		quadratic3d.evaluate_adjoint(0, 1, value, adjoint, [](int id) { return 2.0 + id; }, gradient);
+		return gradient[ia] == da && gradient[ib] == db;
+	}());
+}
+
+namespace
+{
+	int failures = 0;
+
+	/// Report a runtime check that failed.
+	void check(bool ok, std::string_view what)
+	{
+		if (!ok) {
+			std::print("failed: {}\n", what);
+			++failures;
+		}
+	}
+
+	/// A field with a different value for every scalar id and point.
+	auto field(int id, int i) -> double
+	{
+		return 1.0 + 0.5 * id + 0.25 * i;
+	}
+
+	/// The constants accessor for the systems that don't have any constants.
+	auto no_constants(int) -> double
+	{
+		return 0;
+	}
+
+	/// An output accessor over `data`, for `n` points.
+	auto accessor(std::vector<double>& data, int n)
+	{
+		return [&data, n](int id, int i) -> double& {
+			return data[std::size_t(id) * n + i];
+		};
+	}
+
+	/// The SIMD evaluation matches the serial evaluation exactly, including
+	/// the remainder that doesn't fill a pack.
+	void check_simd()
+	{
+		constexpr int n = 7;
+		std::vector<double> serial(shared3d.n_scalars * n);
+		std::vector<double> simd(serial.size());
+		shared3d.evaluate(0, n, field, no_constants, accessor(serial, n));
+		shared3d.evaluate_simd<4>(0, n, field, no_constants, accessor(simd, n));
+		check(simd == serial, "evaluate_simd<4> matches evaluate");
+	}
+
+	/// The parallel evaluation matches the serial evaluation with either
+	/// schedule, and the deterministic schedule is reproducible.
+	void check_parallel()
+	{
+		constexpr int n = 1000;
+		std::vector<double> serial(shared3d.n_scalars * n);
+		shared3d.evaluate(0, n, field, no_constants, accessor(serial, n));
+
+		// Small tiles, so that every worker gets some.
+		ttl::ThreadPool pool(4, 64);
+		std::vector<double> stealing(serial.size());
+		shared3d.evaluate(pool, 0, n, field, no_constants, accessor(stealing, n));
+		check(stealing == serial, "the stealing schedule matches evaluate");
+
+		pool.schedule = ttl::ThreadPool::DETERMINISTIC;
+		std::remove_cvref_t<decltype(shared3d)>::Workspaces workspaces;
+		std::vector<double> first(serial.size());
+		std::vector<double> second(serial.size());
+		shared3d.evaluate(pool, 0, n, workspaces, field, no_constants, accessor(first, n), ttl::update::assign());
+		shared3d.evaluate(pool, 0, n, workspaces, field, no_constants, accessor(second, n), ttl::update::assign());
+		check(first == serial, "the deterministic schedule matches evaluate");
+		check(first == second, "the deterministic schedule is reproducible");
+	}
+
+	/// An exception that a worker throws is rethrown by the caller once all of
+	/// the workers are done, and the pool can still be used.
+	void check_pool_exceptions()
+	{
+		ttl::ThreadPool pool(4, 64, ttl::ThreadPool::DETERMINISTIC);
+
+		// With the deterministic schedule, the last worker's tiles are never
+		// run by the calling thread.
+		bool rethrown = false;
+		try {
+			pool.parallel_for(0, 1000, [&](int worker, int, int) {
+				if (worker == pool.size() - 1) {
+					throw std::runtime_error("worker");
+				}
+			});
+		} catch (std::runtime_error const&) {
+			rethrown = true;
+		}
+		check(rethrown, "parallel_for rethrows a worker's exception");
+
+		std::atomic<int> count = 0;
+		pool.parallel_for(0, 1000, [&](int, int b, int e) {
+			count += e - b;
+		});
+		check(count == 1000, "the pool runs jobs after an exception");
+	}
+
+	/// Profiling records one call per point for every tree and node, and the
+	/// nodes' time fits within their tree's time.
+	void check_profile()
+	{
+		using System = std::remove_cvref_t<decltype(shared3d)>;
+		constexpr int n = 5;
+		std::vector<double> out(shared3d.n_scalars * n);
+		System::Workspace ws;
+		System::Profile prof {};
+		shared3d.evaluate(0, n, ws, field, no_constants, accessor(out, n), ttl::update::assign(), prof);
+
+		bool counts = true;
+		bool times = true;
+		for (int t = shared3d.first_point_tree; t < shared3d.n_trees; ++t) {
+			std::uint64_t nodes = 0;
+			counts = counts && prof.trees[t].count == n;
+			for (int k = shared3d.node_offsets[t]; k < shared3d.node_offsets[t + 1]; ++k) {
+				counts = counts && prof.nodes[k].count == n;
+				nodes += prof.nodes[k].cycles;
+			}
+			times = times && nodes <= prof.trees[t].cycles;
+		}
+		check(counts, "the profile counts every tree and node once per point");
+		check(times, "the nodes' time adds up to at most their tree's time");
+
+		if (std::FILE* file = std::tmpfile()) {
+			prof.report(file);
+			check(std::ftell(file) > 0, "report() prints the profile");
+			std::fclose(file);
+		}
+	}
+
+	/// The scalars that the trees read are gathered once per point, even
+	/// though u is read by several nodes of both trees, and the gathered
+	/// values give the same results as the scalarized program, which reads
+	/// the scalars accessor directly.
+	void check_gather()
+	{
+		constexpr int n = 5;
+		std::vector<int> counts(shared3d.n_scalars * n);
+		auto counting = [&](int id, int i) {
+			++counts[std::size_t(id) * n + i];
+			return field(id, i);
+		};
+
+		std::vector<double> gathered(shared3d.n_scalars * n);
+		std::vector<double> direct(gathered.size());
+		shared3d.evaluate(0, n, counting, no_constants, accessor(gathered, n));
+		shared3d.evaluate_scalarized(0, n, field, no_constants, accessor(direct, n));
+
+		bool once = true;
+		for (int id = 0; id < shared3d.n_scalars; ++id) {
+			bool read = std::ranges::contains(shared3d.gathered_ids, id);
+			for (int i = 0; i < n; ++i) {
+				once = once && counts[std::size_t(id) * n + i] == (read ? 1 : 0);
+			}
+		}
+		check(once, "each scalar is read once per point");
+		check(std::ranges::contains(shared3d.gathered_ids, scalar_id(shared3d, u, 0)), "u is gathered");
+
+		bool ok = true;
+		for (std::size_t k = 0; k < gathered.size(); ++k) {
+			ok = ok && std::abs(gathered[k] - direct[k]) <= 1e-14 * std::abs(direct[k]);
+		}
+		check(ok, "the gathered scalars match the scalarized program");
+	}
+
+	/// The fused updates write out += dt * rhs and out = a * u + b * rhs for
+	/// the right-hand sides that assign() writes.
+	void check_updates()
+	{
+		constexpr int n = 7;
+		constexpr double dt = 0.125;
+		constexpr double a = 0.75;
+		constexpr double b = 0.25;
+		auto initial = [](int id, int i) { return 2.0 - 0.5 * id + 0.125 * i; };
+
+		std::vector<double> rhs(shared3d.n_scalars * n);
+		shared3d.evaluate(0, n, field, no_constants, accessor(rhs, n));
+
+		std::vector<double> increment(rhs.size());
+		std::vector<double> stage(rhs.size());
+		for (int id = 0; id < shared3d.n_scalars; ++id) {
+			for (int i = 0; i < n; ++i) {
+				accessor(increment, n)(id, i) = initial(id, i);
+			}
+		}
+		shared3d.evaluate(0, n, field, no_constants, accessor(increment, n), ttl::update::axpy(dt));
+		shared3d.evaluate(0, n, field, no_constants, accessor(stage, n), ttl::update::axpby(a, b, field));
+
+		bool axpy = true;
+		bool axpby = true;
+		for (int id : shared3d.outputs) {
+			for (int i = 0; i < n; ++i) {
+				double f = accessor(rhs, n)(id, i);
+				double x = initial(id, i) + dt * f;
+				double y = a * field(id, i) + b * f;
+				axpy = axpy && std::abs(accessor(increment, n)(id, i) - x) <= 1e-14 * std::abs(x);
+				axpby = axpby && std::abs(accessor(stage, n)(id, i) - y) <= 1e-14 * std::abs(y);
+			}
+		}
+		check(axpy, "update::axpy adds dt times the right-hand side");
+		check(axpby, "update::axpby combines the state and the right-hand side");
+	}
+
+	constexpr ttl::Tensor q = ttl::scalar("q");
+	constexpr ttl::Tensor G = ttl::vector("G");
+	constexpr ttl::Tensor H = ttl::matrix("H");
+
+	// The Laplacian, gradient, and Hessian of q.
+	constexpr ttl::System derivatives = {
+		q <<= D(q, i, i),
+		G <<= D(q, i),
+		H <<= D(q, i, j)
+	};
+
+	constexpr ttl::ExecutableSystem<double, 2, derivatives> derivatives2d;
+
+	/// The second order stencils are exact for a quadratic field, so the
+	/// derivatives that evaluate() reads through the stencil match the
+	/// analytic ones to round-off.
+	void check_stencil()
+	{
+		using Stencil = std::remove_cvref_t<decltype(derivatives2d)>::Stencil<2>;
+		static_assert(Stencil::halo == 1);
+
+		constexpr std::array<int, 2> extents = { 5, 4 };
+		constexpr std::array<double, 2> h = { 0.5, 0.25 };
+		constexpr int n = extents[0] * extents[1];
+		Stencil stencil(extents, h);
+
+		// The id of the derivative ∂q/∂x^α[0]y^α[1].
+		auto derivative = [](int ax, int ay) {
+			for (int id = 0; id < derivatives2d.n_scalars; ++id) {
+				ttl::Scalar const& s = derivatives2d.scalars[id];
+				auto α = [&](int d) { return (d < s.α.size()) ? int(s.α[d]) : 0; };
+				if (s.tensor == q && s.order != 0 && α(0) == ax && α(1) == ay) {
+					return id;
+				}
+			}
+			return -1;
+		};
+
+		// The linear offsets of the taps for `id`, in the order of the taps.
+		auto offsets = [&](int id) {
+			std::vector<int> out;
+			for (int t = Stencil::tap_offsets[id]; t < Stencil::tap_offsets[id + 1]; ++t) {
+				out.push_back(stencil.offsets[t]);
+			}
+			std::ranges::sort(out);
+			return out;
+		};
+
+		check(offsets(derivative(2, 0)) == std::vector { -1, 0, 1 }, "the ∂xx stencil reaches along x");
+		check(offsets(derivative(0, 2)) == std::vector { -5, 0, 5 }, "the ∂yy stencil reaches along y");
+		check(offsets(derivative(1, 1)) == std::vector { -6, -4, 4, 6 }, "the ∂xy stencil reaches the corners");
+
+		auto coordinates = [&](int i) {
+			return std::array { h[0] * (i % extents[0]), h[1] * (i / extents[0]) };
+		};
+
+		auto scalars = stencil([&](int p, int i) {
+			auto [x, y] = coordinates(i);
+			return (Stencil::primals[p].tensor == q) ? x * x + 3 * x * y + 2 * y * y : 0.0;
+		});
+
+		// The id of the component (a, b) of an output tensor.
+		auto component = [](ttl::Tensor const& t, int a, int b = 0) {
+			for (int id = 0; id < derivatives2d.n_scalars; ++id) {
+				ttl::Scalar const& s = derivatives2d.scalars[id];
+				if (s.tensor == t && s.order == 0 && s.index[0] == a && (t.order() < 2 || s.index[1] == b)) {
+					return id;
+				}
+			}
+			return -1;
+		};
+
+		std::vector<double> out(derivatives2d.n_scalars * n);
+		bool ok = true;
+		auto expect = [&](int id, int i, double value) {
+			ok = ok && std::abs(accessor(out, n)(id, i) - value) <= 1e-12 * std::max(1.0, std::abs(value));
+		};
+
+		for (int i = 0; i < n; ++i) {
+			if (!stencil.is_interior(i)) {
+				continue;
+			}
+			derivatives2d.evaluate(i, i + 1, scalars, no_constants, accessor(out, n));
+
+			auto [x, y] = coordinates(i);
+			expect(scalar_id(derivatives2d, q), i, 6);
+			expect(component(G, 0), i, 2 * x + 3 * y);
+			expect(component(G, 1), i, 3 * x + 4 * y);
+			expect(component(H, 0, 0), i, 2);
+			expect(component(H, 0, 1), i, 3);
+			expect(component(H, 1, 0), i, 3);
+			expect(component(H, 1, 1), i, 4);
+		}
+		check(ok, "the stencil derivatives of a quadratic are exact");
+	}
+
+	/// The scalarized program computes the same outputs as the executable
+	/// trees, up to the order in which it sums.
+	void check_scalarized()
+	{
+		constexpr int n = 7;
+		std::vector<double> trees(shared3d.n_scalars * n);
+		std::vector<double> scalarized(trees.size());
+		shared3d.evaluate(0, n, field, no_constants, accessor(trees, n));
+		shared3d.evaluate_scalarized(0, n, field, no_constants, accessor(scalarized, n));
+
+		bool ok = true;
+		for (std::size_t k = 0; k < trees.size(); ++k) {
+			ok = ok && std::abs(scalarized[k] - trees[k]) <= 1e-14 * std::abs(trees[k]);
+		}
+		check(ok, "evaluate_scalarized matches evaluate");
+	}
+
+	constexpr ttl::Tensor M = ttl::matrix("M");
+	constexpr ttl::Tensor s = ttl::scalar("s");
+	constexpr ttl::Tensor v = ttl::vector("v");
+
+	// s' = tr M + s, v' = M v, and M' = s I, once the deltas are eliminated.
+	constexpr ttl::System deltas = {
+		s <<= ttl::delta(i, j) * M(i, j) + s,
+		v <<= ttl::delta(i, j) * M(j, k) * v(k),
+		M <<= ttl::delta(i, j) * ttl::delta(j, k) * s
+	};
+
+	constexpr ttl::ExecutableSystem<double, 3, deltas> deltas3d;
+
+	/// The rewritten deltas compute the same values as the hand-expanded sums.
+	void check_deltas()
+	{
+		auto m = [](int a, int b) { return 1.0 + a + 3.0 * b; };
+		auto x = [](int a) { return 2.0 - a; };
+		constexpr double s0 = 0.5;
+
+		std::vector<double> out(deltas3d.n_scalars);
+		deltas3d.evaluate(
+			0, 1,
+			[&](int id, int) {
+				auto const& scalar = deltas3d.scalars[id];
+				if (scalar.tensor == M) {
+					return m(scalar.index[0], scalar.index[1]);
+				}
+				return (scalar.tensor == v) ? x(scalar.index[0]) : s0;
+			},
+			no_constants, accessor(out, 1));
+
+		bool ok = true;
+		for (int id : deltas3d.outputs) {
+			auto const& scalar = deltas3d.scalars[id];
+			double expected = s0 + m(0, 0) + m(1, 1) + m(2, 2);
+			if (scalar.tensor == M) {
+				expected = (scalar.index[0] == scalar.index[1]) ? s0 : 0.0;
+			} else if (scalar.tensor == v) {
+				expected = m(scalar.index[0], 0) * x(0) + m(scalar.index[0], 1) * x(1) + m(scalar.index[0], 2) * x(2);
+			}
+			ok = ok && std::abs(out[id] - expected) <= 1e-14 * std::max(1.0, std::abs(expected));
+		}
+		check(ok, "the delta rewrites match the expanded sums");
+	}
+
+	constexpr ttl::Tensor K = ttl::matrix("K");
+
+	// c K(i,j) and c K(j,i) are the same constant with its outer labels
+	// swapped, so only one of them is hoisted.
+	constexpr ttl::System hoisted = {
+		A <<= c * K(i, j) + A(i, j),
+		B <<= c * K(j, i) - B(i, j)
+	};
+
+	// The same equations, but c and K change, so nothing is hoisted.
+	constexpr ttl::System unhoisted = {
+		A <<= c * K(i, j) + A(i, j),
+		B <<= c * K(j, i) - B(i, j),
+		c <<= -c,
+		K <<= -K(i, j)
+	};
+
+	constexpr ttl::ExecutableSystem<double, 3, hoisted> hoisted3d;
+	constexpr ttl::ExecutableSystem<double, 3, unhoisted> unhoisted3d;
+	static_assert(hoisted3d.n_constant_trees == 1);
+	static_assert(hoisted3d.n_bound_constants == 10 && hoisted3d.constants.size() == 19);
+	static_assert(unhoisted3d.n_constant_trees == 0);
+
+	/// The hoisted system computes the same outputs as the unhoisted one, and
+	/// its derived constants are computed by evaluate() rather than read from
+	/// the caller's accessor.
+	void check_hoisting()
+	{
+		auto value = [](auto const& scalar) {
+			if (scalar.tensor == c) {
+				return 1.5;
+			}
+			double x = 1.0 + scalar.index[0] + 3.0 * scalar.index[1];
+			return (scalar.tensor == K) ? x : (scalar.tensor == A) ? 2.0 - x : 0.25 * x;
+		};
+
+		std::vector<double> folded(hoisted3d.n_scalars);
+		hoisted3d.evaluate(
+			0, 1,
+			[&](int id, int) { return value(hoisted3d.scalars[id]); },
+			[&](int id) { return (id < hoisted3d.n_bound_constants) ? value(hoisted3d.constants[id]) : std::nan(""); },
+			accessor(folded, 1));
+
+		std::vector<double> expanded(unhoisted3d.n_scalars);
+		unhoisted3d.evaluate(
+			0, 1,
+			[&](int id, int) { return value(unhoisted3d.scalars[id]); },
+			no_constants, accessor(expanded, 1));
+
+		bool ok = true;
+		for (int id : hoisted3d.outputs) {
+			auto const& scalar = hoisted3d.scalars[id];
+			for (int jd : unhoisted3d.outputs) {
+				if (unhoisted3d.scalars[jd].tensor == scalar.tensor && unhoisted3d.scalars[jd].index == scalar.index) {
+					ok = ok && std::abs(folded[id] - expanded[jd]) <= 1e-14 * std::abs(expanded[jd]);
+				}
+			}
+		}
+		check(ok, "the hoisted constants match the unhoisted system");
+	}
+
+	constexpr ttl::Tensor E = ttl::matrix("E");
+	constexpr ttl::Tensor R = ttl::Tensor("R", 4);
+	constexpr ttl::Index l = 'l';
+
+	// One equation for each of the product kernels: a scalar broadcast and a
+	// matrix-matrix product, a matrix-vector product, a sum with a transposed
+	// operand, an outer product, a double contraction, and a rank-4 by rank-2
+	// contraction. Every tensor is on a left-hand-side, so nothing is hoisted.
+	constexpr ttl::System products = {
+		C <<= p * A(i, j) * B(j, k),
+		u <<= A(i, j) * v(j),
+		A <<= B(i, j) + A(j, i),
+		B <<= u(i) * v(j),
+		p <<= A(i, j) * B(i, j),
+		E <<= R(i, k, j, l) * B(k, l),
+		v <<= -v(i),
+		R <<= -R(i, j, k, l)
+	};
+
+	constexpr ttl::ExecutableSystem<double, 3, products> products3d;
+
+	/// The product kernels compute the same values as hand-written loops.
+	void check_products()
+	{
+		constexpr int n = 3;
+		auto a = [](int x, int y) { return 1.0 + x + 3.0 * y; };
+		auto b = [](int x, int y) { return 2.0 - x + 0.5 * y; };
+		auto r = [](int x, int y, int z, int w) { return 1.0 + x - y + 0.5 * z + 0.25 * w; };
+		auto vu = [](int x) { return 0.5 + x; };
+		auto uu = [](int x) { return 1.0 - 0.25 * x; };
+		constexpr double p0 = 1.5;
+
+		auto value = [&](auto const& s) {
+			auto const& x = s.index;
+			if (s.tensor == A) {
+				return a(x[0], x[1]);
+			}
+			if (s.tensor == B) {
+				return b(x[0], x[1]);
+			}
+			if (s.tensor == R) {
+				return r(x[0], x[1], x[2], x[3]);
+			}
+			if (s.tensor == v) {
+				return vu(x[0]);
+			}
+			return (s.tensor == u) ? uu(x[0]) : p0;
+		};
+
+		auto expected = [&](auto const& s) {
+			auto const& x = s.index;
+			double sum = 0;
+			if (s.tensor == C) {
+				for (int y = 0; y < n; ++y) {
+					sum += p0 * a(x[0], y) * b(y, x[1]);
+				}
+			} else if (s.tensor == u) {
+				for (int y = 0; y < n; ++y) {
+					sum += a(x[0], y) * vu(y);
+				}
+			} else if (s.tensor == A) {
+				sum = a(x[1], x[0]) + b(x[0], x[1]);
+			} else if (s.tensor == B) {
+				sum = uu(x[0]) * vu(x[1]);
+			} else if (s.tensor == p) {
+				for (int y = 0; y < n; ++y) {
+					for (int z = 0; z < n; ++z) {
+						sum += a(y, z) * b(y, z);
+					}
+				}
+			} else if (s.tensor == E) {
+				for (int y = 0; y < n; ++y) {
+					for (int z = 0; z < n; ++z) {
+						sum += r(x[0], y, x[1], z) * b(y, z);
+					}
+				}
+			} else if (s.tensor == v) {
+				sum = -vu(x[0]);
+			} else {
+				sum = -r(x[0], x[1], x[2], x[3]);
+			}
+			return sum;
+		};
+
+		std::vector<double> out(products3d.n_scalars);
+		products3d.evaluate(
+			0, 1,
+			[&](int id, int) { return value(products3d.scalars[id]); },
+			no_constants, accessor(out, 1));
+
+		bool ok = products3d.outputs.size() == 9 + 3 + 9 + 9 + 1 + 9 + 3 + 81;
+		for (int id : products3d.outputs) {
+			double e = expected(products3d.scalars[id]);
+			ok = ok && std::abs(out[id] - e) <= 1e-14 * std::max(1.0, std::abs(e));
+		}
+		check(ok, "the product kernels match hand-written loops");
+	}
+
+	// Only the diagonal of a scaled delta is stored, 3 elements for the delta,
+	// 1 for a, and 3 for the result rather than 9 + 1 + 9.
+	static_assert([] {
+		ttl::TensorTree t(C, ttl::delta(i, j) * a, non_constant);
+		return t.root()->footprint(3) == 3 && t.shape(3).stack_depth == 7;
+	}());
+
+	// A rank-4 product of a delta stores 27 of its 81 elements.
+	static_assert([] {
+		ttl::TensorTree t(R, ttl::delta(i, j) * A(k, l), non_constant);
+		return t.root()->footprint(3) == 27 && t.shape(3).stack_depth == 3 + 9 + 27;
+	}());
+
+	// A dense term fills in the zeros of a sum, so the sum is only computed in
+	// place when its left operand is the dense one.
+	static_assert([] {
+		ttl::TensorTree t(R, ttl::delta(i, j) * A(k, l) + R(i, j, k, l), non_constant);
+		auto const* x = t.root()->a();
+		auto const* y = t.root()->b();
+		bool sparse = std::min(x->footprint(3), y->footprint(3)) == 27;
+		return t.root()->footprint(3) == 81 && sparse && t.root()->in_place(3) == (x->footprint(3) == 81);
+	}());
+
+	// The deltas leave structural zeros in the rank-2 and rank-4 results, and
+	// in the rank-3 intermediates of the derivative.
+	constexpr ttl::System sparse = {
+		M <<= ttl::delta(i, j) * s - M(i, j),
+		R <<= ttl::delta(i, j) * E(k, l),
+		E <<= D(ttl::delta(i, j) * s * v(k), k),
+		s <<= -s,
+		v <<= -v(i)
+	};
+
+	constexpr ttl::ExecutableSystem<double, 3, sparse> sparse3d;
+
+	/// The kernels that only compute the structural nonzeros match the
+	/// scalarized program, which doesn't compact the tensors, and the results
+	/// have zeros where they should.
+	void check_sparse()
+	{
+		constexpr int n = 5;
+		std::vector<double> trees(sparse3d.n_scalars * n);
+		std::vector<double> simd(trees.size());
+		std::vector<double> scalarized(trees.size());
+		sparse3d.evaluate(0, n, field, no_constants, accessor(trees, n));
+		sparse3d.evaluate_simd<4>(0, n, field, no_constants, accessor(simd, n));
+		sparse3d.evaluate_scalarized(0, n, field, no_constants, accessor(scalarized, n));
+
+		bool ok = true;
+		for (int id : sparse3d.outputs) {
+			for (int i = 0; i < n; ++i) {
+				double x = accessor(scalarized, n)(id, i);
+				ok = ok && std::abs(accessor(trees, n)(id, i) - x) <= 1e-14 * std::max(1.0, std::abs(x));
+			}
+		}
+		check(ok, "the sparse kernels match evaluate_scalarized");
+		check(simd == trees, "the sparse kernels match with evaluate_simd<4>");
+
+		// M' = s I - M, and δ(i,j) E(k,l) is nonzero in 27 places whichever
+		// pair of labels the result is stored by.
+		bool diagonal = true;
+		int nonzeros = 0;
+		for (int id : sparse3d.outputs) {
+			auto const& x = sparse3d.scalars[id];
+			double y = trees[std::size_t(id) * n];
+			if (x.tensor == M) {
+				double e = ((x.index[0] == x.index[1]) ? field(scalar_id(sparse3d, s), 0) : 0.0) - field(id, 0);
+				diagonal = diagonal && std::abs(y - e) <= 1e-14 * std::max(1.0, std::abs(e));
+			}
+			nonzeros += (x.tensor == R && y != 0);
+		}
+		check(diagonal, "a scaled delta only adds to the diagonal");
+		check(nonzeros == 27, "a rank-4 product of a delta has 27 nonzeros");
+	}
+
+	constexpr ttl::Tensor w = ttl::scalar("w");
+
+	// w' = -w, so w(1) = 1/e when w(0) = 1.
+	constexpr ttl::System decay = {
+		w <<= -w
+	};
+
+	using Decay = ttl::ExecutableSystem<double, 1, decay>;
+
+	/// The error at t = 1 of integrating w' = -w with `n` steps.
+	template <class Scheme>
+	auto decay_error(int n) -> double
+	{
+		constexpr int id = Decay::outputs[0];
+		ttl::RungeKutta<Decay, Scheme> rk(1);
+		rk.state(id, 0) = 1;
+		for (int s = 0; s < n; ++s) {
+			rk.step(1.0 / n, [](auto u) { return u; }, no_constants);
+		}
+		return std::abs(rk.state(id, 0) - std::exp(-1.0));
+	}
+
+	/// Halving the step size reduces the error by 2^order.
+	template <class Scheme>
+	void check_order(int order, std::string_view what)
+	{
+		double observed = std::log2(decay_error<Scheme>(10) / decay_error<Scheme>(20));
+		check(std::abs(observed - order) < 0.2, what);
+	}
+
+	// A system with products and quotients, for the dual numbers.
+	constexpr ttl::System rational = {
+		x <<= x * y + y / x,
+		y <<= x / y - a * y
+	};
+
+	constexpr ttl::ExecutableSystem<double, 2, rational> rational2d;
+	static_assert(rational2d.constants.size() == 1);
+
+	/// The Jacobian-vector products match central differences of evaluate()
+	/// along each direction.
+	void check_tangents()
+	{
+		constexpr int n = 3;
+		constexpr int K = 2;
+		constexpr double h = 1e-5;
+		auto constant = [](int) { return 2.0; };
+		auto seed = [](int id, int i, int k) { return 0.5 + 0.25 * id - 0.125 * i + k; };
+
+		std::vector<double> out(rational2d.n_scalars * n);
+		std::vector<double> tangents(out.size() * K);
+		rational2d.evaluate_tangents<K>(0, n, field, seed, constant, accessor(out, n), [&](int id, int i, int k) -> double& {
+			return tangents[(std::size_t(id) * n + i) * K + k];
+		});
+
+		std::vector<double> values(out.size());
+		rational2d.evaluate(0, n, field, constant, accessor(values, n));
+		check(out == values, "evaluate_tangents computes the same values as evaluate");
+
+		bool ok = true;
+		for (int k = 0; k < K; ++k) {
+			std::vector<double> plus(out.size());
+			std::vector<double> minus(out.size());
+			rational2d.evaluate(0, n, [&](int id, int i) { return field(id, i) + h * seed(id, i, k); }, constant, accessor(plus, n));
+			rational2d.evaluate(0, n, [&](int id, int i) { return field(id, i) - h * seed(id, i, k); }, constant, accessor(minus, n));
+			for (int id : rational2d.outputs) {
+				for (int i = 0; i < n; ++i) {
+					double fd = (accessor(plus, n)(id, i) - accessor(minus, n)(id, i)) / (2 * h);
+					double jvp = tangents[(std::size_t(id) * n + i) * K + k];
+					ok = ok && std::abs(jvp - fd) <= 1e-7 * std::max(1.0, std::abs(jvp));
+				}
+			}
+		}
+		check(ok, "evaluate_tangents matches central differences");
+	}
 }
 
 int main()
 {
-	return 0;
+	check_simd();
+	check_parallel();
+	check_pool_exceptions();
+	check_profile();
+	check_gather();
+	check_updates();
+	check_stencil();
+	check_scalarized();
+	check_deltas();
+	check_hoisting();
+	check_products();
+	check_sparse();
+	check_order<ttl::rk::Euler>(1, "Euler is first order");
+	check_order<ttl::rk::SSPRK3>(3, "SSPRK3 is third order");
+	check_order<ttl::rk::RK4>(4, "RK4 is fourth order");
+	check_order<ttl::rk::LSRK54>(4, "LSRK54 is fourth order");
+	check_tangents();
+	return (failures) ? 1 : 0;
 }